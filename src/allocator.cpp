@@ -0,0 +1,604 @@
+#include "allocator.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <bit>
+
+// LeakSanitizer doesn't look for pointers in mapped memory unless told to,
+// and would report the arrays that objects own as leaked.
+#ifdef __SANITIZE_ADDRESS__
+#include <sanitizer/asan_interface.h>
+#include <sanitizer/lsan_interface.h>
+#define POISON_BLOCK(block, size) ASAN_POISON_MEMORY_REGION(block, size)
+#define UNPOISON_BLOCK(block, size) ASAN_UNPOISON_MEMORY_REGION(block, size)
+#define REGISTER_ARENA(base, size) __lsan_register_root_region(base, size)
+#define UNREGISTER_ARENA(base, size) __lsan_unregister_root_region(base, size)
+#else
+#define POISON_BLOCK(block, size) ((void)(block), (void)(size))
+#define UNPOISON_BLOCK(block, size) ((void)(block), (void)(size))
+#define REGISTER_ARENA(base, size) ((void)(base), (void)(size))
+#define UNREGISTER_ARENA(base, size) ((void)(base), (void)(size))
+#endif
+
+// Classes up to SLAB_MAX_BLOCK, and those from there to
+// SLAB_MAX_OBJECT_BLOCK, which only objects use.
+#define SMALL_CLASS_COUNT (SLAB_MAX_BLOCK / SLAB_GRANULE)
+#define CLASSES_PER_DOUBLING 4
+#define OBJECT_CLASS_DOUBLINGS 5
+#define SIZE_CLASS_COUNT \
+    (SMALL_CLASS_COUNT + CLASSES_PER_DOUBLING * OBJECT_CLASS_DOUBLINGS)
+
+// Large object slabs are sized in pages, header included.
+#define LARGE_PAGE_SIZE 4096
+
+// Empty slabs kept per size class when the rest are released, so a class
+// that is in use doesn't keep giving up and taking back its last slab.
+#define SLABS_KEPT 1
+
+// Slabs come out of arenas mapped straight from the system, so that the
+// memory of a released slab can be given back with madvise() while its
+// arena stays mapped. Arenas are aligned to their size, a multiple of the
+// huge page size, and the ones mapped once the heap has grown past
+// ARENA_HUGE_PAGE_COUNT arenas ask for transparent huge pages.
+#define ARENA_SLABS 64
+#define ARENA_SIZE ((size_t)SLAB_SIZE * ARENA_SLABS)
+#define ARENA_HUGE_PAGE_COUNT 4
+
+namespace lox
+{
+
+#define SLAB_HEADER_SIZE                                  \
+    ((sizeof(Slab) + SLAB_GRANULE - 1) & ~(size_t)(SLAB_GRANULE - 1))
+
+static_assert((SLAB_MAX_BLOCK << OBJECT_CLASS_DOUBLINGS) ==
+                SLAB_MAX_OBJECT_BLOCK,
+              "object classes must double up to SLAB_MAX_OBJECT_BLOCK");
+
+struct Arena
+{
+    Arena* next;
+    char* base;
+    uint64_t freeSlots; // Bit i set if the i-th slab of the arena is free.
+};
+
+static Arena* arenas;
+static int arenaCount;
+static size_t largeBytes; // Mapped for large object slabs.
+static size_t residentBytes;
+
+static Slab* slabs;
+
+// Slabs of each size class that have free blocks, those holding objects and
+// those holding arrays apart. Full slabs are in no such list until a block of
+// theirs is freed, and neither are slabs being evacuated.
+static Slab* partialSlabs[2][SIZE_CLASS_COUNT];
+
+// Large object slabs whose object was freed, to be unmapped by
+// releaseEmptySlabs(). Until then a walk over the objects may still be
+// passing through them. Linked through nextPartial.
+static Slab* emptyLargeSlabs;
+
+static int sizeClassOf(size_t size)
+{
+    if (size <= SLAB_MAX_BLOCK) return (int)((size - 1) / SLAB_GRANULE);
+
+    // Past SLAB_MAX_BLOCK, classes step up by a quarter of the power of two
+    // below them.
+    int log = (int)std::bit_width(size - 1) - 1;
+    size_t base = (size_t)1 << log;
+    int quarter = (int)((size - 1 - base) / (base / CLASSES_PER_DOUBLING));
+    return SMALL_CLASS_COUNT +
+           (log - std::countr_zero((unsigned)SLAB_MAX_BLOCK)) *
+             CLASSES_PER_DOUBLING +
+           quarter;
+}
+
+static size_t classSize(int sizeClass)
+{
+    if (sizeClass < SMALL_CLASS_COUNT)
+        return (size_t)(sizeClass + 1) * SLAB_GRANULE;
+
+    int step = sizeClass - SMALL_CLASS_COUNT;
+    size_t base = (size_t)SLAB_MAX_BLOCK << (step / CLASSES_PER_DOUBLING);
+    size_t quarter = base / CLASSES_PER_DOUBLING;
+    return base + quarter * (step % CLASSES_PER_DOUBLING + 1);
+}
+
+static int blocksPerSlab(int sizeClass)
+{
+    return (int)((SLAB_SIZE - SLAB_HEADER_SIZE) / classSize(sizeClass));
+}
+
+static size_t largeSlabSize(size_t size)
+{
+    return (SLAB_HEADER_SIZE + size + LARGE_PAGE_SIZE - 1) &
+           ~(size_t)(LARGE_PAGE_SIZE - 1);
+}
+
+static bool isSmall(size_t size)
+{
+    return size > 0 && size <= SLAB_MAX_BLOCK;
+}
+
+size_t blockSize(size_t size)
+{
+    if (!isSmall(size)) return size;
+    return (size + SLAB_GRANULE - 1) & ~(size_t)(SLAB_GRANULE - 1);
+}
+
+static void linkPartial(Slab* slab)
+{
+    Slab** head = &partialSlabs[slab->holdsObjects][slab->sizeClass];
+    slab->prevPartial = NULL;
+    slab->nextPartial = *head;
+    if (*head != NULL) (*head)->prevPartial = slab;
+    *head = slab;
+}
+
+static void unlinkPartial(Slab* slab)
+{
+    if (slab->prevPartial != NULL)
+        slab->prevPartial->nextPartial = slab->nextPartial;
+    else
+        partialSlabs[slab->holdsObjects][slab->sizeClass] = slab->nextPartial;
+    if (slab->nextPartial != NULL)
+        slab->nextPartial->prevPartial = slab->prevPartial;
+}
+
+static void linkSlab(Slab* slab)
+{
+    slab->prev = NULL;
+    slab->next = slabs;
+    if (slabs != NULL) slabs->prev = slab;
+    slabs = slab;
+}
+
+static void unlinkSlab(Slab* slab)
+{
+    if (slab->prev != NULL)
+        slab->prev->next = slab->next;
+    else
+        slabs = slab->next;
+    if (slab->next != NULL) slab->next->prev = slab->prev;
+}
+
+// Maps size bytes aligned to alignment, by mapping that much more and
+// trimming.
+static char* mapAligned(size_t size, size_t alignment)
+{
+    char* address = (char*)mmap(NULL, size + alignment, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (address == MAP_FAILED) exit(1);
+
+    char* base = (char*)(((uintptr_t)address + alignment - 1) &
+                         ~(uintptr_t)(alignment - 1));
+    if (base > address) munmap(address, base - address);
+    munmap(base + size, address + alignment - base);
+    return base;
+}
+
+static Arena* mapArena()
+{
+    char* base = mapAligned(ARENA_SIZE, ARENA_SIZE);
+
+#ifdef MADV_HUGEPAGE
+    if (arenaCount >= ARENA_HUGE_PAGE_COUNT)
+        madvise(base, ARENA_SIZE, MADV_HUGEPAGE);
+#endif
+    REGISTER_ARENA(base, ARENA_SIZE);
+
+    Arena* arena = (Arena*)malloc(sizeof(Arena));
+    if (arena == NULL) exit(1);
+    arena->next = arenas;
+    arena->base = base;
+    arena->freeSlots = ~(uint64_t)0;
+    arenas = arena;
+    arenaCount++;
+    return arena;
+}
+
+static Slab* arenaSlab(Arena* arena, int slot)
+{
+    return (Slab*)(arena->base + (size_t)slot * SLAB_SIZE);
+}
+
+static Slab* takeSlab()
+{
+    Arena* arena = arenas;
+    while (arena != NULL && arena->freeSlots == 0) arena = arena->next;
+    if (arena == NULL) arena = mapArena();
+
+    int slot = std::countr_zero(arena->freeSlots);
+    arena->freeSlots &= ~((uint64_t)1 << slot);
+    residentBytes += SLAB_SIZE;
+
+    Slab* slab = arenaSlab(arena, slot);
+    slab->arena = arena;
+    return slab;
+}
+
+// Gives the slab's memory back to the system. Its address range stays
+// mapped for the next slab, unless its whole arena is free.
+static void giveBackSlab(Slab* slab)
+{
+    Arena* arena = slab->arena;
+    int slot = (int)(((char*)slab - arena->base) / SLAB_SIZE);
+    UNPOISON_BLOCK(slab, SLAB_SIZE);
+    madvise(slab, SLAB_SIZE, MADV_DONTNEED);
+    arena->freeSlots |= (uint64_t)1 << slot;
+    residentBytes -= SLAB_SIZE;
+
+    if (arena->freeSlots != ~(uint64_t)0) return;
+    Arena** link = &arenas;
+    while (*link != arena) link = &(*link)->next;
+    *link = arena->next;
+    UNREGISTER_ARENA(arena->base, ARENA_SIZE);
+    munmap(arena->base, ARENA_SIZE);
+    free(arena);
+    arenaCount--;
+}
+
+static void freeSlab(Slab* slab)
+{
+    if (!slab->isEvacuating) unlinkPartial(slab);
+    unlinkSlab(slab);
+    giveBackSlab(slab);
+}
+
+static Slab* newSlab(int sizeClass, bool holdsObjects)
+{
+    Slab* slab = takeSlab();
+
+    size_t size = classSize(sizeClass);
+    int count = blocksPerSlab(sizeClass);
+    char* blocks = (char*)slab + SLAB_HEADER_SIZE;
+
+    // Thread the free list in address order.
+    slab->freeBlocks = NULL;
+    for (int i = count - 1; i >= 0; i--)
+    {
+        void* block = blocks + i * size;
+        *(void**)block = slab->freeBlocks;
+        slab->freeBlocks = block;
+        POISON_BLOCK(block, size);
+    }
+    slab->blockBytes = size;
+    slab->sizeClass = sizeClass;
+    slab->usedCount = 0;
+    slab->holdsObjects = holdsObjects;
+    slab->isEvacuating = false;
+    memset(slab->marks, 0, sizeof(slab->marks));
+    memset(slab->objects, 0, sizeof(slab->objects));
+
+    linkSlab(slab);
+    linkPartial(slab);
+    return slab;
+}
+
+static void* allocateSmall(size_t size, bool holdsObjects)
+{
+    int sizeClass = sizeClassOf(size);
+    Slab* slab = partialSlabs[holdsObjects][sizeClass];
+    if (slab == NULL) slab = newSlab(sizeClass, holdsObjects);
+
+    void* block = slab->freeBlocks;
+    UNPOISON_BLOCK(block, slab->blockBytes);
+    slab->freeBlocks = *(void**)block;
+    slab->usedCount++;
+    if (slab->freeBlocks == NULL) unlinkPartial(slab);
+
+    if (holdsObjects)
+    {
+        uintptr_t granule = ((uintptr_t)block & (SLAB_SIZE - 1)) / SLAB_GRANULE;
+        slab->objects[granule / 64] |= (uint64_t)1 << (granule % 64);
+    }
+    return block;
+}
+
+static void freeSmall(void* block)
+{
+    Slab* slab = slabOf(block);
+    if (slab->holdsObjects)
+    {
+        uintptr_t granule = ((uintptr_t)block & (SLAB_SIZE - 1)) / SLAB_GRANULE;
+        slab->objects[granule / 64] &= ~((uint64_t)1 << (granule % 64));
+    }
+    if (slab->freeBlocks == NULL) linkPartial(slab);
+    *(void**)block = slab->freeBlocks;
+    slab->freeBlocks = block;
+    slab->usedCount--;
+    POISON_BLOCK(block, slab->blockBytes);
+}
+
+static void* allocateLarge(size_t size)
+{
+    size_t mapped = largeSlabSize(size);
+    Slab* slab = (Slab*)mapAligned(mapped, SLAB_SIZE);
+    REGISTER_ARENA(slab, mapped);
+    largeBytes += mapped;
+    residentBytes += mapped;
+
+    slab->arena = NULL;
+    slab->freeBlocks = NULL;
+    slab->blockBytes = mapped - SLAB_HEADER_SIZE;
+    slab->sizeClass = LARGE_SIZE_CLASS;
+    slab->usedCount = 1;
+    slab->holdsObjects = true;
+    slab->isEvacuating = false;
+    memset(slab->marks, 0, sizeof(slab->marks));
+    memset(slab->objects, 0, sizeof(slab->objects));
+    int granule = SLAB_HEADER_SIZE / SLAB_GRANULE;
+    slab->objects[granule / 64] = (uint64_t)1 << (granule % 64);
+    linkSlab(slab);
+    return (char*)slab + SLAB_HEADER_SIZE;
+}
+
+static void unmapLarge(Slab* slab)
+{
+    size_t mapped = SLAB_HEADER_SIZE + slab->blockBytes;
+    largeBytes -= mapped;
+    residentBytes -= mapped;
+    UNPOISON_BLOCK(slab, mapped);
+    UNREGISTER_ARENA(slab, mapped);
+    munmap(slab, mapped);
+}
+
+void* resizeBlock(void* block, size_t oldSize, size_t newSize)
+{
+    if (block == NULL) oldSize = 0;
+
+    if (newSize == 0)
+    {
+        if (isSmall(oldSize))
+            freeSmall(block);
+        else
+            free(block);
+        return NULL;
+    }
+
+    if (!isSmall(oldSize) && !isSmall(newSize))
+    {
+        void* result = realloc(block, newSize);
+        if (result == NULL) exit(1);
+        return result;
+    }
+    if (block != NULL && blockSize(oldSize) == blockSize(newSize))
+        return block;
+
+    void* result =
+      isSmall(newSize) ? allocateSmall(newSize, false) : malloc(newSize);
+    if (result == NULL) exit(1);
+    if (block != NULL)
+    {
+        memcpy(result, block, oldSize < newSize ? oldSize : newSize);
+        resizeBlock(block, oldSize, 0);
+    }
+    return result;
+}
+
+void* allocateObjectBlock(size_t size)
+{
+    if (size > SLAB_MAX_OBJECT_BLOCK) return allocateLarge(size);
+    return allocateSmall(size, true);
+}
+
+void freeObjectBlock(void* block)
+{
+    Slab* slab = slabOf(block);
+    if (slab->sizeClass != LARGE_SIZE_CLASS)
+    {
+        freeSmall(block);
+        return;
+    }
+
+    memset(slab->objects, 0, sizeof(slab->objects));
+    slab->usedCount = 0;
+    POISON_BLOCK(block, slab->blockBytes);
+    slab->nextPartial = emptyLargeSlabs;
+    emptyLargeSlabs = slab;
+}
+
+size_t objectBlockSize(size_t size)
+{
+    if (size > SLAB_MAX_OBJECT_BLOCK)
+        return largeSlabSize(size) - SLAB_HEADER_SIZE;
+    return classSize(sizeClassOf(size));
+}
+
+BlockCursor firstObjectBlock()
+{
+    return BlockCursor{slabs, 0};
+}
+
+void* nextObjectBlock(BlockCursor* cursor)
+{
+    for (; cursor->slab != NULL;
+         cursor->slab = cursor->slab->next, cursor->granule = 0)
+    {
+        Slab* slab = cursor->slab;
+        if (!slab->holdsObjects) continue;
+
+        for (int word = cursor->granule / 64; word < SLAB_MARK_WORDS; word++)
+        {
+            uint64_t bits = slab->objects[word];
+            if (word == cursor->granule / 64)
+                bits &= ~(uint64_t)0 << (cursor->granule % 64);
+            if (bits == 0) continue;
+
+            int granule = word * 64 + std::countr_zero(bits);
+            cursor->granule = granule + 1;
+            return (char*)slab + granule * SLAB_GRANULE;
+        }
+    }
+    return NULL;
+}
+
+void releaseEmptySlabs()
+{
+    while (emptyLargeSlabs != NULL)
+    {
+        Slab* slab = emptyLargeSlabs;
+        emptyLargeSlabs = slab->nextPartial;
+        unlinkSlab(slab);
+        unmapLarge(slab);
+    }
+
+    for (int kind = 0; kind < 2; kind++)
+    {
+        for (int i = 0; i < SIZE_CLASS_COUNT; i++)
+        {
+            int kept = 0;
+            Slab* slab = partialSlabs[kind][i];
+            while (slab != NULL)
+            {
+                Slab* next = slab->nextPartial;
+                if (slab->usedCount == 0 && kept++ >= SLABS_KEPT)
+                    freeSlab(slab);
+                slab = next;
+            }
+        }
+    }
+}
+
+// Blocks still in use are dropped along with their slabs.
+void freeSlabs()
+{
+    for (Slab* slab = slabs; slab != NULL;)
+    {
+        Slab* next = slab->next;
+        if (slab->sizeClass == LARGE_SIZE_CLASS) unmapLarge(slab);
+        slab = next;
+    }
+    emptyLargeSlabs = NULL;
+
+    while (arenas != NULL)
+    {
+        Arena* arena = arenas;
+        arenas = arena->next;
+        UNPOISON_BLOCK(arena->base, ARENA_SIZE);
+        UNREGISTER_ARENA(arena->base, ARENA_SIZE);
+        munmap(arena->base, ARENA_SIZE);
+        free(arena);
+    }
+    arenaCount = 0;
+    residentBytes = 0;
+    slabs = NULL;
+    memset(partialSlabs, 0, sizeof(partialSlabs));
+}
+
+size_t heapCommittedBytes()
+{
+    return (size_t)arenaCount * ARENA_SIZE + largeBytes;
+}
+
+size_t heapResidentBytes()
+{
+    return residentBytes;
+}
+
+void clearMarks()
+{
+    for (Slab* slab = slabs; slab != NULL; slab = slab->next)
+        memset(slab->marks, 0, sizeof(slab->marks));
+}
+
+int reclaimableSlabs(int* slabCount)
+{
+    int slabCounts[SIZE_CLASS_COUNT] = {0};
+    int usedCounts[SIZE_CLASS_COUNT] = {0};
+    for (Slab* slab = slabs; slab != NULL; slab = slab->next)
+    {
+        if (!slab->holdsObjects || slab->sizeClass == LARGE_SIZE_CLASS)
+            continue;
+        slabCounts[slab->sizeClass]++;
+        usedCounts[slab->sizeClass] += slab->usedCount;
+    }
+
+    int reclaimable = 0;
+    *slabCount = 0;
+    for (int i = 0; i < SIZE_CLASS_COUNT; i++)
+    {
+        int perSlab = blocksPerSlab(i);
+        int needed = (usedCounts[i] + perSlab - 1) / perSlab;
+        reclaimable += slabCounts[i] - needed;
+        *slabCount += slabCounts[i];
+    }
+    return reclaimable;
+}
+
+static int compareUsedCounts(const void* a, const void* b)
+{
+    return (*(Slab* const*)a)->usedCount - (*(Slab* const*)b)->usedCount;
+}
+
+// Picks the slabs of one size class to evacuate: the sparsest ones, for as
+// long as the free blocks of the denser ones can take their blocks.
+static int pickEvacuated(Slab** classSlabs, int count, int sizeClass)
+{
+    qsort(classSlabs, count, sizeof(Slab*), compareUsedCounts);
+
+    int perSlab = blocksPerSlab(sizeClass);
+    int room = 0; // Free blocks in the slabs that stay.
+    for (int i = 0; i < count; i++) room += perSlab - classSlabs[i]->usedCount;
+
+    int moved = 0;
+    int picked = 0;
+    for (int i = 0; i < count; i++)
+    {
+        Slab* slab = classSlabs[i];
+        room -= perSlab - slab->usedCount;
+        if (moved + slab->usedCount > room) break;
+        moved += slab->usedCount;
+
+        if (slab->freeBlocks != NULL) unlinkPartial(slab);
+        slab->isEvacuating = true;
+        picked++;
+    }
+    return picked;
+}
+
+int startEvacuation()
+{
+    int slabCount = 0;
+    for (Slab* slab = slabs; slab != NULL; slab = slab->next) slabCount++;
+    Slab** classSlabs = (Slab**)malloc(sizeof(Slab*) * (slabCount + 1));
+    if (classSlabs == NULL) exit(1);
+
+    int picked = 0;
+    for (int i = 0; i < SIZE_CLASS_COUNT; i++)
+    {
+        int count = 0;
+        for (Slab* slab = slabs; slab != NULL; slab = slab->next)
+        {
+            if (slab->holdsObjects && slab->sizeClass == i)
+                classSlabs[count++] = slab;
+        }
+        picked += pickEvacuated(classSlabs, count, i);
+    }
+
+    free(classSlabs);
+    return picked;
+}
+
+void* evacuateBlock(void* block)
+{
+    size_t size = objectBlockSize(block);
+    void* copy = allocateSmall(size, true);
+    memcpy(copy, block, size);
+    return copy;
+}
+
+void finishEvacuation()
+{
+    Slab* slab = slabs;
+    while (slab != NULL)
+    {
+        Slab* next = slab->next;
+        if (slab->isEvacuating) freeSlab(slab);
+        slab = next;
+    }
+}
+
+} // namespace lox
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <atomic>
+
+#include "common.h"
+
+// Small blocks, which is to say most objects and most of the arrays hanging
+// off them, are carved out of slabs instead of going to malloc one by one. A
+// slab holds blocks of a single size class, and every class is a multiple of
+// SLAB_GRANULE bytes up to SLAB_MAX_BLOCK. Larger arrays go to malloc.
+// Objects get slabs of their own, apart from arrays. That way the collector
+// can walk every object slab by slab rather than keeping them in a list (see
+// nextObjectBlock()), and compactHeap() can empty a slab by moving the
+// objects out of it.
+//
+// Strings keep their characters inline, so objects can be of any size.
+// Object classes go on past SLAB_MAX_BLOCK, four to each doubling, up to
+// SLAB_MAX_OBJECT_BLOCK. An object larger than that gets a slab to itself,
+// sized to fit it.
+#define SLAB_SIZE (64 * 1024)
+#define SLAB_GRANULE 16
+#define SLAB_MAX_BLOCK 256
+#define SLAB_MAX_OBJECT_BLOCK (8 * 1024)
+
+#define SLAB_MARK_WORDS (SLAB_SIZE / SLAB_GRANULE / 64)
+
+#define LARGE_SIZE_CLASS -1
+
+namespace lox
+{
+
+struct Arena;
+
+// A slab starts with this header, followed by its blocks. Slabs are aligned
+// to SLAB_SIZE, so a block finds its slab by masking its address.
+//
+// The collector's mark bits live in the header rather than in the objects,
+// one bit per granule for the block starting there, so marking never writes
+// to an object and clearing the marks is a memset per slab. Object slabs
+// keep a second bitmap of the blocks in use, the same way.
+struct Slab
+{
+    Arena* arena; // Where its memory comes from.
+    Slab* prev;   // Every slab.
+    Slab* next;
+    Slab* prevPartial; // Slabs of the size class with free blocks.
+    Slab* nextPartial;
+    void* freeBlocks; // Each free block holds a pointer to the next.
+    size_t blockBytes; // Of each of its blocks.
+    int sizeClass;     // LARGE_SIZE_CLASS for a large object's slab.
+    int usedCount;
+    bool holdsObjects;
+    bool isEvacuating; // Its objects are being moved out, see compactHeap().
+    uint64_t marks[SLAB_MARK_WORDS];
+    uint64_t objects[SLAB_MARK_WORDS];
+};
+
+inline Slab* slabOf(const void* block)
+{
+    return (Slab*)((uintptr_t)block & ~(uintptr_t)(SLAB_SIZE - 1));
+}
+
+inline uint64_t* markWord(const void* block, uint64_t* bit)
+{
+    uintptr_t granule = ((uintptr_t)block & (SLAB_SIZE - 1)) / SLAB_GRANULE;
+    *bit = (uint64_t)1 << (granule % 64);
+    return &slabOf(block)->marks[granule / 64];
+}
+
+inline bool isBlockMarked(const void* block)
+{
+    uint64_t bit;
+    return (*markWord(block, &bit) & bit) != 0;
+}
+
+inline void markBlock(const void* block)
+{
+    uint64_t bit;
+    *markWord(block, &bit) |= bit;
+}
+
+inline void unmarkBlock(const void* block)
+{
+    uint64_t bit;
+    *markWord(block, &bit) &= ~bit;
+}
+
+// Marks block, which may race with other threads marking blocks of the same
+// slab. Returns false if it was already marked.
+inline bool markBlockAtomic(const void* block)
+{
+    uint64_t bit;
+    std::atomic_ref<uint64_t> word(*markWord(block, &bit));
+    return (word.fetch_or(bit, std::memory_order_relaxed) & bit) == 0;
+}
+
+// Unmarks every block. Blocks are unmarked when freed, as only unmarked
+// objects are freed, so new blocks start out unmarked.
+void clearMarks();
+
+// Bytes a block of size actually takes up.
+size_t blockSize(size_t size);
+
+// Like realloc, except the caller passes the size it asked for last time.
+// A size of 0 means no block: resizing from 0 allocates, to 0 frees.
+void* resizeBlock(void* block, size_t oldSize, size_t newSize);
+
+// Allocates a block for an object of size.
+void* allocateObjectBlock(size_t size);
+void freeObjectBlock(void* block);
+
+// Bytes an object block of size takes up.
+size_t objectBlockSize(size_t size);
+
+// Bytes the object block takes up, from its slab.
+inline size_t objectBlockSize(const void* block)
+{
+    return slabOf(block)->blockBytes;
+}
+
+// A position in the walk over every object block in use. The walk goes
+// slab by slab in address order within each slab. It sees blocks freed
+// behind it as gone and skips slabs created since it started.
+struct BlockCursor
+{
+    Slab* slab;
+    int granule;
+};
+
+BlockCursor firstObjectBlock();
+// The next object block in use, or NULL once the walk is done.
+void* nextObjectBlock(BlockCursor* cursor);
+
+// Returns the memory of slabs that have no blocks in use to the system.
+void releaseEmptySlabs();
+void freeSlabs();
+
+// Address space mapped for slabs, and the part of it that slabs currently
+// take up. Memory given back to the system is no longer resident.
+size_t heapCommittedBytes();
+size_t heapResidentBytes();
+
+// Object slabs that moving objects into the gaps of the others would empty,
+// and how many object slabs there are in all.
+int reclaimableSlabs(int* slabCount);
+
+// Evacuation empties the sparsest object slabs of each size class. Once
+// startEvacuation() has picked them, evacuateBlock() copies a block of one
+// of them to a slab that stays, and finishEvacuation() frees the emptied
+// slabs with whatever their blocks still hold.
+inline bool isEvacuating(const void* block)
+{
+    return slabOf(block)->isEvacuating;
+}
+
+int startEvacuation();
+void* evacuateBlock(void* block);
+void finishEvacuation();
+
+} // namespace lox
@@ -1,6 +1,12 @@
 #include "chunk.h"
 
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
 #include "memory.h"
+#include "object.h"
 #include "value.h"
 #include "vm.h"
 
@@ -12,15 +18,22 @@ void Chunk::init()
     count_ = 0;
     capacity_ = 0;
     code_ = NULL;
+    lineCount_ = 0;
+    lineCapacity_ = 0;
     lines_ = NULL;
     constants_.init();
+    cacheCount_ = 0;
+    cacheCapacity_ = 0;
+    caches_ = NULL;
 }
 
 void Chunk::free()
 {
-    FREE_ARRAY(uint8_t, code_, capacity_);
-    FREE_ARRAY(int, lines_, capacity_);
+    // Borrowed code has no capacity and isn't ours to free.
+    if (capacity_ > 0) FREE_ARRAY(uint8_t, code_, capacity_);
+    FREE_ARRAY(LineStart, lines_, lineCapacity_);
     constants_.free();
+    FREE_ARRAY(InlineCache, caches_, cacheCapacity_);
     init();
 }
 
@@ -31,12 +44,51 @@ void Chunk::write(uint8_t byte, int line)
         int oldCapacity = capacity_;
         capacity_ = GROW_CAPACITY(oldCapacity);
         code_ = GROW_ARRAY(uint8_t, code_, oldCapacity, capacity_);
-        lines_ = GROW_ARRAY(int, lines_, oldCapacity, capacity_);
     }
 
     code_[count_] = byte;
-    lines_[count_] = line;
     count_++;
+
+    // Only start a new run when the line changes.
+    if (lineCount_ > 0 && lines_[lineCount_ - 1].line == line) return;
+
+    if (lineCapacity_ < lineCount_ + 1)
+    {
+        int oldCapacity = lineCapacity_;
+        lineCapacity_ = GROW_CAPACITY(oldCapacity);
+        lines_ = GROW_ARRAY(LineStart, lines_, oldCapacity, lineCapacity_);
+    }
+
+    LineStart* lineStart = &lines_[lineCount_++];
+    lineStart->offset = count_ - 1;
+    lineStart->line = line;
+}
+
+// Drops the code from offset count on, along with the line runs that only
+// covered it.
+void Chunk::truncate(int count)
+{
+    count_ = count;
+    while (lineCount_ > 0 && lines_[lineCount_ - 1].offset >= count)
+        lineCount_--;
+}
+
+// The source line of the instruction at offset: the line of the last run
+// starting at or before it.
+int Chunk::getLine(int offset) const
+{
+    int start = 0;
+    int end = lineCount_ - 1;
+
+    while (start < end)
+    {
+        int mid = start + (end - start + 1) / 2;
+        if (lines_[mid].offset <= offset)
+            start = mid;
+        else
+            end = mid - 1;
+    }
+    return lines_[start].line;
 }
 
 int Chunk::addConstant(Value value)
@@ -47,4 +99,279 @@ int Chunk::addConstant(Value value)
     return constants_.count() - 1;
 }
 
+int Chunk::addInlineCache()
+{
+    if (cacheCapacity_ < cacheCount_ + 1)
+    {
+        int oldCapacity = cacheCapacity_;
+        cacheCapacity_ = GROW_CAPACITY(oldCapacity);
+        caches_ =
+          GROW_ARRAY(InlineCache, caches_, oldCapacity, cacheCapacity_);
+    }
+
+    InlineCache* cache = &caches_[cacheCount_];
+    for (int i = 0; i < INLINE_CACHE_SIZE; i++)
+    {
+        cache->entries[i].shape = NULL;
+        cache->entries[i].classId = 0;
+        cache->entries[i].classSerial = 0;
+        cache->entries[i].method = NULL;
+        cache->entries[i].transition = NULL;
+        cache->entries[i].slot = -1;
+    }
+    return cacheCount_++;
+}
+
+// Size in bytes of the instruction at offset, operands included.
+int Chunk::instructionSize(int offset) const
+{
+    switch (code_[offset])
+    {
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_CALL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_CLASS:
+        case OP_METHOD:
+        case OP_GET_SUPER: return 2;
+
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP:
+        case OP_LOOP:
+        case OP_GET_LOCAL_LONG:
+        case OP_SET_LOCAL_LONG:
+        case OP_GET_UPVALUE_LONG:
+        case OP_SET_UPVALUE_LONG:
+        case OP_ADD_LOCALS:
+        case OP_SUBTRACT_LOCALS:
+        case OP_MULTIPLY_LOCALS:
+        case OP_DIVIDE_LOCALS:
+        case OP_INCREMENT_LOCAL: return 3;
+
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_CONSTANT_LONG:
+        case OP_JUMP_IF_FALSE_LONG:
+        case OP_JUMP_LONG:
+        case OP_LOOP_LONG:
+        case OP_CLASS_LONG:
+        case OP_METHOD_LONG:
+        case OP_GET_SUPER_LONG:
+        case OP_JUMP_IF_LESS:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_GREATER:
+        case OP_JUMP_IF_NOT_GREATER: return 4;
+
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE: return 5;
+
+        case OP_GET_PROPERTY_LONG:
+        case OP_SET_PROPERTY_LONG: return 6;
+
+        case OP_INVOKE_LONG:
+        case OP_SUPER_INVOKE_LONG: return 7;
+
+        case OP_CLOSURE:
+        {
+            ObjFunction* function =
+              AS_FUNCTION(constants_.elems()[code_[offset + 1]]);
+            return 2 + function->upvalueCount * 2;
+        }
+        case OP_CLOSURE_LONG:
+        {
+            ObjFunction* function =
+              AS_FUNCTION(constants_.elems()[readLong(offset + 1)]);
+            return 4 + function->upvalueCount * 3;
+        }
+
+        default: return 1;
+    }
+}
+
+// How many values the instruction at offset pops, and how many it pushes
+// after that.
+void Chunk::stackEffect(int offset, int* pops, int* pushes) const
+{
+    *pops = 0;
+    *pushes = 0;
+    switch (code_[offset])
+    {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_GLOBAL:
+        case OP_GET_LOCAL:
+        case OP_GET_LOCAL_LONG:
+        case OP_GET_UPVALUE:
+        case OP_GET_UPVALUE_LONG:
+        case OP_CLOSURE:
+        case OP_CLOSURE_LONG:
+        case OP_CLASS:
+        case OP_CLASS_LONG:
+        case OP_ADD_LOCALS:
+        case OP_SUBTRACT_LOCALS:
+        case OP_MULTIPLY_LOCALS:
+        case OP_DIVIDE_LOCALS: *pushes = 1; break;
+
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_METHOD:
+        case OP_METHOD_LONG:
+        case OP_GET_SUPER:
+        case OP_GET_SUPER_LONG:
+        case OP_SET_PROPERTY:
+        case OP_SET_PROPERTY_LONG:
+        case OP_INHERIT: *pops = 2; *pushes = 1; break;
+
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_SET_GLOBAL:
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_LONG:
+        case OP_SET_UPVALUE:
+        case OP_SET_UPVALUE_LONG:
+        case OP_GET_PROPERTY:
+        case OP_GET_PROPERTY_LONG:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_FALSE_LONG: *pops = 1; *pushes = 1; break;
+
+        case OP_PRINT:
+        case OP_POP:
+        case OP_CLOSE_UPVALUE:
+        case OP_DEFINE_GLOBAL:
+        case OP_RETURN:
+        case OP_JUMP_IF_LESS:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_GREATER:
+        case OP_JUMP_IF_NOT_GREATER: *pops = 1; break;
+
+        // The callee and its arguments.
+        case OP_CALL: *pops = code_[offset + 1] + 1; *pushes = 1; break;
+        case OP_INVOKE: *pops = code_[offset + 2] + 1; *pushes = 1; break;
+        case OP_INVOKE_LONG: *pops = code_[offset + 4] + 1; *pushes = 1; break;
+        // The superclass too.
+        case OP_SUPER_INVOKE: *pops = code_[offset + 2] + 2; *pushes = 1; break;
+        case OP_SUPER_INVOKE_LONG:
+            *pops = code_[offset + 4] + 2;
+            *pushes = 1;
+            break;
+
+        // The jumps and OP_INCREMENT_LOCAL.
+        default: break;
+    }
+}
+
+// Where the instruction at offset can jump to, or -1 if it can't.
+int Chunk::jumpTarget(int offset) const
+{
+    switch (code_[offset])
+    {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE: return offset + 3 + readShort(offset + 1);
+        case OP_LOOP: return offset + 3 - readShort(offset + 1);
+        case OP_JUMP_LONG:
+        case OP_JUMP_IF_FALSE_LONG:
+            return offset + 4 + (int)readLong(offset + 1);
+        case OP_LOOP_LONG: return offset + 4 - (int)readLong(offset + 1);
+        case OP_JUMP_IF_LESS:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_GREATER:
+        case OP_JUMP_IF_NOT_GREATER: return offset + 4 + readShort(offset + 2);
+        default: return -1;
+    }
+}
+
+// The most values the code has on the stack when it starts with height
+// there. Assumes the code is well formed, as the compiler emits it and the
+// loader verifies it: every path into an instruction arrives with the same
+// height.
+int Chunk::maxStackHeight(int height) const
+{
+    std::vector<int> heights(count_, -1);
+    std::vector<int> pending;
+    heights[0] = height;
+    pending.push_back(0);
+    int maxHeight = height;
+
+    while (!pending.empty())
+    {
+        int offset = pending.back();
+        pending.pop_back();
+
+        int pops;
+        int pushes;
+        stackEffect(offset, &pops, &pushes);
+        int next = heights[offset] - pops + pushes;
+        // OP_ADD_LOCALS pushes both operands before taking the slow path.
+        maxHeight = std::max(maxHeight, next + 1);
+
+        uint8_t instruction = code_[offset];
+        bool fallsThrough = instruction != OP_RETURN &&
+                            instruction != OP_JUMP &&
+                            instruction != OP_JUMP_LONG &&
+                            instruction != OP_LOOP &&
+                            instruction != OP_LOOP_LONG;
+        int successors[2] = {
+          fallsThrough ? offset + instructionSize(offset) : -1,
+          jumpTarget(offset)};
+        for (int successor : successors)
+        {
+            if (successor == -1 || successor >= count_) continue;
+            if (heights[successor] != -1) continue;
+            heights[successor] = next;
+            pending.push_back(successor);
+        }
+    }
+    return maxHeight;
+}
+
+// Points the chunk at code that lives elsewhere, e.g. in a memory-mapped
+// bytecode file, instead of copying it. The chunk must not be written to
+// afterwards, and the code has to outlive it.
+void Chunk::borrowCode(const uint8_t* code, int count)
+{
+    code_ = const_cast<uint8_t*>(code);
+    count_ = count;
+    capacity_ = 0;
+}
+
+void Chunk::setLines(const LineStart* lines, int count)
+{
+    lines_ = GROW_ARRAY(LineStart, lines_, lineCapacity_, count);
+    memcpy(lines_, lines, sizeof(LineStart) * count);
+    lineCount_ = count;
+    lineCapacity_ = count;
+}
+
+// Replaces the code with a version that is no longer than the current one,
+// as produced by the peephole optimizer. lines holds one entry per byte and
+// is re-encoded into runs, which can only get fewer.
+void Chunk::rewrite(int count, const uint8_t* code, const int* lines)
+{
+    memcpy(code_, code, count);
+    count_ = count;
+
+    lineCount_ = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (lineCount_ > 0 && lines_[lineCount_ - 1].line == lines[i])
+            continue;
+        lines_[lineCount_].offset = i;
+        lines_[lineCount_].line = lines[i];
+        lineCount_++;
+    }
+}
+
 } // namespace lox
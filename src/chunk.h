@@ -8,70 +8,162 @@ namespace lox
 
 typedef enum
 {
-    OP_RETURN,
-    OP_NOT,
-    OP_NEGATE,
-    OP_CONSTANT,
-    OP_ADD,
-    OP_SUBTRACT,
-    OP_MULTIPLY,
-    OP_DIVIDE,
-    OP_NIL,
-    OP_TRUE,
-    OP_FALSE,
-    OP_EQUAL,
-    OP_GREATER,
-    OP_LESS,
-    OP_PRINT,
-    OP_POP,
-    OP_DEFINE_GLOBAL,
-    OP_GET_GLOBAL,
-    OP_SET_GLOBAL,
-    OP_GET_LOCAL,
-    OP_SET_LOCAL,
-    OP_JUMP_IF_FALSE,
-    OP_JUMP,
-    OP_LOOP,
-    OP_CALL,
-    OP_CLOSURE,
-    OP_GET_UPVALUE,
-    OP_SET_UPVALUE,
-    OP_CLOSE_UPVALUE,
-    OP_CLASS,
-    OP_GET_PROPERTY,
-    OP_SET_PROPERTY,
-    OP_METHOD,
-    OP_INVOKE,
-    OP_INHERIT,
-    OP_GET_SUPER,
-    OP_SUPER_INVOKE
+#define OPCODE(name) name,
+#include "opcodes.h"
+#undef OPCODE
 } OpCode;
 
+struct Shape;
+
+// Largest constant index or jump offset the wide instruction forms encode.
+#define UINT24_MAX 0xffffff
+
+// Number of receivers a property or method site remembers before it goes
+// megamorphic and falls back to the full lookup every time.
+#define INLINE_CACHE_SIZE 4
+
+// An entry is one of:
+//  - a field entry (method == NULL): receivers of this shape keep the
+//    property in slot. At OP_SET_PROPERTY sites, transition is the shape the
+//    receiver moves to when the store adds the field (shape itself otherwise).
+//  - a method entry (method != NULL): receivers of this shape and class
+//    resolve the property to method. OP_SUPER_INVOKE sites have no receiver
+//    shape and key on the class alone (shape == NULL). classSerial is the
+//    class's serial, so that an entry left stale by a change to the class's
+//    methods is refilled rather than kept.
+//
+// Shapes are immortal and a class gets a fresh id whenever its method table
+// changes, with ids never reused, so a stale entry can't match. That also means
+// the GC never has to trace the cached closures: a hit implies the class, and
+// with it the method, is alive.
+struct InlineCacheEntry
+{
+    Shape* shape;
+    uint64_t classId;
+    uint64_t classSerial;
+    ObjClosure* method;
+    Shape* transition;
+    int slot;
+};
+
+struct InlineCache
+{
+    InlineCacheEntry entries[INLINE_CACHE_SIZE];
+
+    // The entry for a receiver of the given shape and class id, NULL on miss.
+    // Checking entries in order keeps the monomorphic case a single compare.
+    InlineCacheEntry* find(const Shape* shape, uint64_t classId)
+    {
+        for (int i = 0; i < INLINE_CACHE_SIZE; i++)
+        {
+            InlineCacheEntry* entry = &entries[i];
+            if (entry->shape != shape) continue;
+            if (entry->method == NULL ? shape != NULL
+                                      : entry->classId == classId)
+                return entry;
+        }
+        return NULL;
+    }
+
+    // The entry to (re)fill for shape and the class of classSerial, 0 for a
+    // field entry: the one already keyed on both, whose class id must be
+    // stale, or else the first empty one. Instances of different classes
+    // often share a shape, so a match on the shape alone takes a slot of its
+    // own. NULL once the site is megamorphic, which then keeps what it has
+    // rather than thrashing.
+    InlineCacheEntry* claim(const Shape* shape, uint64_t classSerial)
+    {
+        // Empty entries have neither, and class-keyed sites always pass a
+        // serial.
+        for (int i = 0; i < INLINE_CACHE_SIZE; i++)
+        {
+            InlineCacheEntry* entry = &entries[i];
+            if (entry->shape == shape && entry->classSerial == classSerial)
+                return entry;
+        }
+
+        for (int i = 0; i < INLINE_CACHE_SIZE; i++)
+            if (entries[i].shape == NULL && entries[i].method == NULL)
+                return &entries[i];
+        return NULL;
+    }
+};
+
+// Start of a run of bytecode compiled from the same source line. A chunk
+// keeps one per run rather than a line per byte.
+struct LineStart
+{
+    int offset;
+    int line;
+};
+
 class Chunk
 {
   public:
-    Chunk() : count_(0), capacity_(0), code_(NULL), lines_(NULL) {}
+    Chunk()
+      : count_(0),
+        capacity_(0),
+        code_(NULL),
+        lineCount_(0),
+        lineCapacity_(0),
+        lines_(NULL),
+        cacheCount_(0),
+        cacheCapacity_(0),
+        caches_(NULL)
+    {
+    }
 
     void init();
     void free();
     void write(uint8_t byte, int line);
     int addConstant(Value value);
+    int addInlineCache();
+    int instructionSize(int offset) const;
+    void stackEffect(int offset, int* pops, int* pushes) const;
+    int jumpTarget(int offset) const;
+    int maxStackHeight(int height) const;
+    void rewrite(int count, const uint8_t* code, const int* lines);
+    void truncate(int count);
+    int getLine(int offset) const;
+    void borrowCode(const uint8_t* code, int count);
+    void setLines(const LineStart* lines, int count);
+
+    // Big-endian 16 and 24-bit operands at offset.
+    uint16_t readShort(int offset) const
+    {
+        return (uint16_t)((code_[offset] << 8) | code_[offset + 1]);
+    }
+    uint32_t readLong(int offset) const
+    {
+        return (uint32_t)((code_[offset] << 16) | (code_[offset + 1] << 8) |
+                          code_[offset + 2]);
+    }
 
     int count() const { return count_; };
     int capacity() const { return capacity_; };
     uint8_t* code() const { return code_; };
-    const int* lines() const { return lines_; };
+    int lineCount() const { return lineCount_; }
+    const LineStart* lineStarts() const { return lines_; }
 
     const ValueArray& constants() const { return constants_; }
     ValueArray* constantsPtr() { return &constants_; }
 
+    int cacheCount() const { return cacheCount_; }
+    InlineCache* caches() const { return caches_; }
+
   private:
     int count_;
     int capacity_;
     uint8_t* code_;
 
-    int* lines_;
+    int lineCount_;
+    int lineCapacity_;
+    LineStart* lines_;
     ValueArray constants_;
+
+    int cacheCount_;
+    int cacheCapacity_;
+    InlineCache* caches_;
 };
 
 } // namespace lox
@@ -12,8 +12,16 @@
 #define NAN_BOXING
 
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT16_COUNT (UINT16_MAX + 1)
 
 // #undef DEBUG_PRINT_CODE
 // #undef DEBUG_TRACE_EXECUTION
 #undef DEBUG_STRESS_GC
 #undef DEBUG_LOG_GC
+
+// VM::run dispatches through a table of label addresses when the compiler
+// supports GNU "labels as values". Configure with -DLOX_COMPUTED_GOTO=OFF to
+// fall back to the portable switch loop.
+#if defined(__GNUC__) && !defined(LOX_NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
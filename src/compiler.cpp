@@ -6,6 +6,7 @@
 
 #include "memory.h"
 #include "object.h"
+#include "optimizer.h"
 #include "scanner.h"
 #include "vm.h"
 #ifdef DEBUG_PRINT_CODE
@@ -118,6 +119,19 @@ Compiler* current = NULL;
 
 ClassCompiler* currentClass = NULL;
 
+// Where an operand starts in the current chunk: the offset of its code and
+// the number of constants before it. Constant folding drops both.
+struct OperandStart
+{
+    int code;
+    int constants;
+};
+
+// Start of the left operand of the infix expression being parsed. Set by
+// parsePrecedence() right before it hands over to an infix rule, which must
+// read it before parsing anything else.
+static OperandStart infixOperandStart = {0, 0};
+
 Chunk* compilingChunk;
 
 static Chunk* currentChunk()
@@ -136,6 +150,11 @@ static void emitBytes(uint8_t byte1, uint8_t byte2)
     emitByte(byte2);
 }
 
+static void emitShort(uint16_t value)
+{
+    emitBytes((value >> 8) & 0xff, value & 0xff);
+}
+
 static bool identifiersEqual(const Token& a, const Token& b)
 {
     if (a.length != b.length) return false;
@@ -153,10 +172,15 @@ void Compiler::init(FunctionType type)
     current = this;
 
     if (type != TYPE_SCRIPT)
-        current->function_->name =
-          copyString(parser.previous().start, parser.previous().length);
+    {
+        storeShared(&current->function_->name,
+                    copyString(parser.previous().start,
+                               parser.previous().length));
+        writeBarrier((Obj*)current->function_,
+                     (Obj*)current->function_->name);
+    }
 
-    Local* local = &locals_[localCount_++];
+    Local* local = pushLocal();
     local->depth = 0;
     local->isCaptured = false;
     if (type != TYPE_FUNCTION)
@@ -171,6 +195,14 @@ void Compiler::init(FunctionType type)
     }
 }
 
+// Claims the next local slot, growing locals_ if this is the deepest the
+// function's locals have gone so far.
+Local* Compiler::pushLocal()
+{
+    if (localCount_ == (int)locals_.size()) locals_.emplace_back();
+    return &locals_[localCount_++];
+}
+
 void Compiler::beginScope()
 {
     scopeDepth_++;
@@ -208,7 +240,7 @@ int Compiler::resolveLocal(const Token& name)
     return -1;
 }
 
-int Compiler::addUpvalue(uint8_t index, bool isLocal)
+int Compiler::addUpvalue(uint16_t index, bool isLocal)
 {
     int upvalueCount = function_->upvalueCount;
 
@@ -219,14 +251,13 @@ int Compiler::addUpvalue(uint8_t index, bool isLocal)
         if (upvalue->index == index && upvalue->isLocal == isLocal) return i;
     }
 
-    if (upvalueCount == UINT8_COUNT)
+    if (upvalueCount == UINT16_COUNT)
     {
         error("Too many closure variables in function.");
         return 0;
     }
 
-    upvalues_[upvalueCount].isLocal = isLocal;
-    upvalues_[upvalueCount].index = index;
+    upvalues_.push_back({index, isLocal});
     return function_->upvalueCount++;
 }
 
@@ -238,11 +269,11 @@ int Compiler::resolveUpvalue(const Token& name)
     if (local != -1)
     {
         enclosing_->locals_[local].isCaptured = true;
-        return addUpvalue((uint8_t)local, true);
+        return addUpvalue((uint16_t)local, true);
     }
 
     int upvalue = enclosing_->resolveUpvalue(name);
-    if (upvalue != -1) return addUpvalue((uint8_t)upvalue, false);
+    if (upvalue != -1) return addUpvalue((uint16_t)upvalue, false);
 
     return -1;
 }
@@ -262,6 +293,15 @@ static ObjFunction* endCompiler()
     emitReturn();
     ObjFunction* function = current->function_;
 
+    if (!parser.hadError())
+    {
+        optimizeChunk(currentChunk());
+        // Locals are pushed like any other value, so this covers them as
+        // well as the temporaries and call arguments above them.
+        function->slotCount =
+          currentChunk()->maxStackHeight(function->arity + 1);
+    }
+
 #ifdef DEBUG_PRINT_CODE
     if (!parser.hadError())
     {
@@ -275,50 +315,121 @@ static ObjFunction* endCompiler()
     return function;
 }
 
-static uint8_t makeConstant(Value value)
+static void emitLong(uint32_t value)
+{
+    emitByte((value >> 16) & 0xff);
+    emitShort(value & 0xffff);
+}
+
+static uint64_t numberBits(double number)
+{
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(double));
+    return bits;
+}
+
+// Returns the index of value in the current chunk's constants, adding it
+// unless an equal number (same bit pattern, so 0 and -0 stay apart) or the
+// same interned string is already there.
+static int makeConstant(Value value)
 {
+    if (IS_NUMBER(value))
+    {
+        uint64_t bits = numberBits(AS_NUMBER(value));
+        auto found = current->numberConstants_.find(bits);
+        if (found != current->numberConstants_.end()) return found->second;
+    }
+    else if (IS_STRING(value))
+    {
+        auto found = current->stringConstants_.find(AS_STRING(value));
+        if (found != current->stringConstants_.end()) return found->second;
+    }
+
     int constant = currentChunk()->addConstant(value);
-    if (constant > UINT8_MAX)
+    writeBarrier((Obj*)current->function_, value);
+    if (IS_NUMBER(value))
+        current->numberConstants_[numberBits(AS_NUMBER(value))] = constant;
+    else if (IS_STRING(value))
+        current->stringConstants_[AS_STRING(value)] = constant;
+
+    if (constant > UINT24_MAX)
     {
         error("Too many constants in one chunk.");
         return 0;
     }
 
-    return (uint8_t)constant;
+    return constant;
+}
+
+// Emits an instruction whose first operand is a constant index: the short
+// form with a byte operand when it fits, else the long one with 24 bits.
+static void emitConstantOp(uint8_t op, uint8_t longOp, int constant)
+{
+    if (constant <= UINT8_MAX)
+        emitBytes(op, (uint8_t)constant);
+    else
+    {
+        emitByte(longOp);
+        emitLong((uint32_t)constant);
+    }
 }
 
 static void emitConstant(Value value)
 {
-    emitBytes(OP_CONSTANT, makeConstant(value));
+    emitConstantOp(OP_CONSTANT, OP_CONSTANT_LONG, makeConstant(value));
+}
+
+// Reserves an inline cache slot in the current chunk for a method lookup
+// site and emits its index as a 16-bit operand.
+static void emitInlineCache()
+{
+    int cache = currentChunk()->addInlineCache();
+    if (cache > UINT16_MAX) error("Too many call sites in one chunk.");
+
+    emitShort((uint16_t)cache);
 }
 
 static void patchJump(int offset)
 {
-    int jump = currentChunk()->count() - offset - 2;
+    int jump = currentChunk()->count() - offset - 3;
 
-    if (jump > UINT16_MAX) error("Too much code to jump over.");
+    if (jump > UINT24_MAX) error("Too much code to jump over.");
 
-    currentChunk()->code()[offset] = (jump >> 8) & 0xff;
-    currentChunk()->code()[offset + 1] = jump & 0xff;
+    currentChunk()->code()[offset] = (jump >> 16) & 0xff;
+    currentChunk()->code()[offset + 1] = (jump >> 8) & 0xff;
+    currentChunk()->code()[offset + 2] = jump & 0xff;
 }
 
+// Forward jumps are always emitted in the long form since their distance
+// isn't known yet. The peephole pass narrows the ones that turn out to fit
+// in 16 bits.
 static int emitJump(uint8_t instruction)
 {
     emitByte(instruction);
-    emitByte(0xff);
-    emitByte(0xff);
-    return currentChunk()->count() - 2;
+    emitLong(UINT24_MAX);
+    return currentChunk()->count() - 3;
 }
 
 static void emitLoop(int loopStart)
 {
-    emitByte(OP_LOOP);
+    int offset = currentChunk()->count() - loopStart + 3;
+    if (offset <= UINT16_MAX)
+    {
+        emitByte(OP_LOOP);
+        emitShort((uint16_t)offset);
+        return;
+    }
+
+    offset++;
+    if (offset > UINT24_MAX) error("Loop body too large.");
 
-    int offset = currentChunk()->count() - loopStart + 2;
-    if (offset > UINT16_MAX) error("Loop body too large.");
+    emitByte(OP_LOOP_LONG);
+    emitLong((uint32_t)offset);
+}
 
-    emitByte((offset >> 8) & 0xff);
-    emitByte(offset & 0xff);
+static OperandStart operandStart()
+{
+    return {currentChunk()->count(), currentChunk()->constants().count()};
 }
 
 /* forward decl */
@@ -397,6 +508,7 @@ static void parsePrecedence(Precedence precedence)
         return;
     }
 
+    OperandStart start = operandStart();
     bool canAssign = precedence <= PREC_ASSIGNMENT;
     prefixRule(canAssign);
 
@@ -404,6 +516,7 @@ static void parsePrecedence(Precedence precedence)
     {
         parser.advance();
         ParseFn infixRule = getRule(parser.previous().type)->infix;
+        infixOperandStart = start;
         infixRule(canAssign);
     }
 
@@ -411,20 +524,32 @@ static void parsePrecedence(Precedence precedence)
         error("Invalid assignment target.");
 }
 
-static uint8_t identifierConstant(const Token& name)
+static int identifierConstant(const Token& name)
 {
     return makeConstant(OBJ_VAL(copyString(name.start, name.length)));
 }
 
+static uint16_t globalSlot(const Token& name)
+{
+    int slot = vm.globalSlot(copyString(name.start, name.length));
+    if (slot > UINT16_MAX)
+    {
+        error("Too many global variables.");
+        return 0;
+    }
+
+    return (uint16_t)slot;
+}
+
 static void addLocal(const Token& name)
 {
-    if (current->localCount_ == UINT8_COUNT)
+    if (current->localCount_ == UINT16_COUNT)
     {
         error("Too many local variables in function.");
         return;
     }
 
-    Local* local = &current->locals_[current->localCount_++];
+    Local* local = current->pushLocal();
     local->name = name;
     local->depth = LOCAL_DECLARE_UNINITIALIZED;
     local->isCaptured = false;
@@ -448,15 +573,15 @@ static void declareVariable()
     addLocal(name);
 }
 
-static uint8_t parseVariable(const char* errorMessage)
+static uint16_t parseVariable(const char* errorMessage)
 {
     parser.consume(TOKEN_IDENTIFIER, errorMessage);
 
     declareVariable();
     if (current->scopeDepth_ > 0)
-        return 0; // In local var, return a dummy table index
+        return 0; // In local var, return a dummy slot
 
-    return identifierConstant(parser.previous());
+    return globalSlot(parser.previous());
 }
 
 static void markInitialized()
@@ -466,7 +591,7 @@ static void markInitialized()
     current->locals_[current->localCount_ - 1].depth = current->scopeDepth_;
 }
 
-static void defineVariable(uint8_t global)
+static void defineVariable(uint16_t global)
 {
     if (current->scopeDepth_ > 0)
     {
@@ -474,7 +599,8 @@ static void defineVariable(uint8_t global)
         return;
     }
 
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitByte(OP_DEFINE_GLOBAL);
+    emitShort(global);
 }
 
 static void namedVariable(const Token& name, bool canAssign)
@@ -493,19 +619,37 @@ static void namedVariable(const Token& name, bool canAssign)
     }
     else
     {
-        arg = identifierConstant(name);
+        arg = globalSlot(name);
         getOp = OP_GET_GLOBAL;
         setOp = OP_SET_GLOBAL;
     }
 
+    uint8_t op = getOp;
     if (canAssign && parser.match(TOKEN_EQUAL))
     {
         expression();
-        emitBytes(setOp, (uint8_t)arg);
+        op = setOp;
     }
+
+    // Global slots take a short operand, locals and upvalues a byte unless
+    // they are past the first 256, which need the long forms.
+    if (op == OP_GET_GLOBAL || op == OP_SET_GLOBAL)
+    {
+        emitByte(op);
+        emitShort((uint16_t)arg);
+    }
+    else if (arg <= UINT8_MAX)
+        emitBytes(op, (uint8_t)arg);
     else
     {
-        emitBytes(getOp, (uint8_t)arg);
+        switch (op)
+        {
+            case OP_GET_LOCAL: emitByte(OP_GET_LOCAL_LONG); break;
+            case OP_SET_LOCAL: emitByte(OP_SET_LOCAL_LONG); break;
+            case OP_GET_UPVALUE: emitByte(OP_GET_UPVALUE_LONG); break;
+            case OP_SET_UPVALUE: emitByte(OP_SET_UPVALUE_LONG); break;
+        }
+        emitShort((uint16_t)arg);
     }
 }
 
@@ -544,20 +688,21 @@ static void super_(bool canAssign)
 
     parser.consume(TOKEN_DOT, "Expect '.' after 'super'.");
     parser.consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-    uint8_t name = identifierConstant(parser.previous());
+    int name = identifierConstant(parser.previous());
 
     namedVariable(syntheticToken("this"), false);
     if (parser.match(TOKEN_LEFT_PAREN))
     {
         uint8_t argCount = argumentList();
         namedVariable(syntheticToken("super"), false);
-        emitBytes(OP_SUPER_INVOKE, name);
+        emitConstantOp(OP_SUPER_INVOKE, OP_SUPER_INVOKE_LONG, name);
         emitByte(argCount);
+        emitInlineCache();
     }
     else
     {
         namedVariable(syntheticToken("super"), false);
-        emitBytes(OP_GET_SUPER, name);
+        emitConstantOp(OP_GET_SUPER, OP_GET_SUPER_LONG, name);
     }
 }
 
@@ -574,22 +719,25 @@ static void this_(bool canAssign)
 static void dot(bool canAssign)
 {
     parser.consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-    uint8_t name = identifierConstant(parser.previous());
+    int name = identifierConstant(parser.previous());
 
     if (canAssign && parser.match(TOKEN_EQUAL))
     {
         expression();
-        emitBytes(OP_SET_PROPERTY, name);
+        emitConstantOp(OP_SET_PROPERTY, OP_SET_PROPERTY_LONG, name);
+        emitInlineCache();
     }
     else if (parser.match(TOKEN_LEFT_PAREN))
     {
         uint8_t argCount = argumentList();
-        emitBytes(OP_INVOKE, name);
+        emitConstantOp(OP_INVOKE, OP_INVOKE_LONG, name);
         emitByte(argCount);
+        emitInlineCache();
     }
     else
     {
-        emitBytes(OP_GET_PROPERTY, name);
+        emitConstantOp(OP_GET_PROPERTY, OP_GET_PROPERTY_LONG, name);
+        emitInlineCache();
     }
 }
 
@@ -638,12 +786,153 @@ static void grouping(bool canAssign)
     parser.consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
+/* constant folding */
+
+// If the code between start and end is a single instruction that pushes a
+// literal, stores that literal in value.
+static bool constantOperand(int start, int end, Value* value)
+{
+    Chunk* chunk = currentChunk();
+    const uint8_t* code = chunk->code();
+    int length = end - start;
+
+    if (length == 1)
+    {
+        switch (code[start])
+        {
+            case OP_NIL: *value = NIL_VAL; return true;
+            case OP_TRUE: *value = BOOL_VAL(true); return true;
+            case OP_FALSE: *value = BOOL_VAL(false); return true;
+            default: return false;
+        }
+    }
+
+    if (length == 2 && code[start] == OP_CONSTANT)
+    {
+        *value = chunk->constants().elems()[code[start + 1]];
+        return true;
+    }
+    if (length == 4 && code[start] == OP_CONSTANT_LONG)
+    {
+        *value = chunk->constants().elems()[chunk->readLong(start + 1)];
+        return true;
+    }
+    return false;
+}
+
+// Drops the operand code and constants from start on and pushes value in
+// their place, so folding never makes a chunk hit the constant limit sooner.
+// All constants added since start belong to the operands: they are single
+// literal pushes, and any folding nested inside them has already cleaned up.
+static void emitFolded(OperandStart start, Value value)
+{
+    ValueArray* constants = currentChunk()->constantsPtr();
+    for (int i = start.constants; i < constants->count(); i++)
+    {
+        Value constant = constants->elems()[i];
+        if (IS_NUMBER(constant))
+            current->numberConstants_.erase(numberBits(AS_NUMBER(constant)));
+        else if (IS_STRING(constant))
+            current->stringConstants_.erase(AS_STRING(constant));
+    }
+    constants->truncate(start.constants);
+    currentChunk()->truncate(start.code);
+
+    if (IS_NIL(value))
+        emitByte(OP_NIL);
+    else if (IS_BOOL(value))
+        emitByte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    else
+        emitConstant(value);
+}
+
+static bool foldUnary(TokenType operatorType, OperandStart start)
+{
+    Value operand;
+    if (!constantOperand(start.code, currentChunk()->count(), &operand))
+        return false;
+
+    switch (operatorType)
+    {
+        case TOKEN_BANG:
+            emitFolded(start, BOOL_VAL(vm.isFalsey(operand)));
+            break;
+        case TOKEN_MINUS:
+            // Negating anything else is a runtime error, leave it to the VM.
+            if (!IS_NUMBER(operand)) return false;
+            emitFolded(start, NUMBER_VAL(-AS_NUMBER(operand)));
+            break;
+        default: return false; // Unreachable.
+    }
+    return true;
+}
+
+// Folds a binary operator over two literal operands. Operand types the VM
+// would reject are left alone so the program still fails at runtime with the
+// usual message. Comparisons mirror the LESS/GREATER + NOT sequences the
+// compiler would otherwise emit, which matters for NaN.
+static bool foldBinary(TokenType operatorType, OperandStart leftStart,
+                       int rightStart)
+{
+    Value a, b;
+    if (!constantOperand(leftStart.code, rightStart, &a) ||
+        !constantOperand(rightStart, currentChunk()->count(), &b))
+        return false;
+
+    switch (operatorType)
+    {
+        case TOKEN_BANG_EQUAL:
+            emitFolded(leftStart, BOOL_VAL(!valuesEqual(a, b)));
+            return true;
+        case TOKEN_EQUAL_EQUAL:
+            emitFolded(leftStart, BOOL_VAL(valuesEqual(a, b)));
+            return true;
+        case TOKEN_PLUS:
+            if (IS_STRING(a) && IS_STRING(b))
+            {
+                ObjString* left = AS_STRING(a);
+                ObjString* right = AS_STRING(b);
+                ObjString* result =
+                  newString(left->length + right->length);
+                memcpy(result->chars, left->chars, left->length);
+                memcpy(result->chars + left->length, right->chars,
+                       right->length);
+                emitFolded(leftStart, OBJ_VAL(takeString(result)));
+                return true;
+            }
+            break;
+        default: break;
+    }
+
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    Value result;
+    switch (operatorType)
+    {
+        case TOKEN_GREATER: result = BOOL_VAL(x > y); break;
+        case TOKEN_GREATER_EQUAL: result = BOOL_VAL(!(x < y)); break;
+        case TOKEN_LESS: result = BOOL_VAL(x < y); break;
+        case TOKEN_LESS_EQUAL: result = BOOL_VAL(!(x > y)); break;
+        case TOKEN_PLUS: result = NUMBER_VAL(x + y); break;
+        case TOKEN_MINUS: result = NUMBER_VAL(x - y); break;
+        case TOKEN_STAR: result = NUMBER_VAL(x * y); break;
+        case TOKEN_SLASH: result = NUMBER_VAL(x / y); break;
+        default: return false; // Unreachable.
+    }
+    emitFolded(leftStart, result);
+    return true;
+}
+
 static void unary(bool canAssign)
 {
     TokenType operatorType = parser.previous().type;
+    OperandStart start = operandStart();
 
     // Compile the operand.
     parsePrecedence(PREC_UNARY);
+    if (foldUnary(operatorType, start)) return;
 
     // Emit the operator instruction.
     switch (operatorType)
@@ -656,12 +945,15 @@ static void unary(bool canAssign)
 
 static void binary(bool canAssign)
 {
-    // Remember the operator.
+    // Remember the operator and where both operands start.
     TokenType operatorType = parser.previous().type;
+    OperandStart leftStart = infixOperandStart;
+    int rightStart = currentChunk()->count();
 
     // Compile the right operand.
     ParseRule* rule = getRule(operatorType);
     parsePrecedence((Precedence)(rule->precedence + 1));
+    if (foldBinary(operatorType, leftStart, rightStart)) return;
 
     // Emit the operator instruction.
     switch (operatorType)
@@ -682,7 +974,7 @@ static void binary(bool canAssign)
 
 static void and_(bool canAssign)
 {
-    int endJump = emitJump(OP_JUMP_IF_FALSE);
+    int endJump = emitJump(OP_JUMP_IF_FALSE_LONG);
 
     emitByte(OP_POP);
     parsePrecedence(PREC_AND);
@@ -692,8 +984,8 @@ static void and_(bool canAssign)
 
 static void or_(bool canAssign)
 {
-    int elseJump = emitJump(OP_JUMP_IF_FALSE);
-    int endJump = emitJump(OP_JUMP);
+    int elseJump = emitJump(OP_JUMP_IF_FALSE_LONG);
+    int endJump = emitJump(OP_JUMP_LONG);
 
     patchJump(elseJump);
     emitByte(OP_POP);
@@ -713,7 +1005,7 @@ static void declaration();
 
 static void varDeclaration()
 {
-    uint8_t global = parseVariable("Expect variable name.");
+    uint16_t global = parseVariable("Expect variable name.");
 
     if (parser.match(TOKEN_EQUAL))
         expression();
@@ -745,12 +1037,12 @@ static void ifStatement()
     expression();
     parser.consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-    int thenJumpOffset = emitJump(OP_JUMP_IF_FALSE);
+    int thenJumpOffset = emitJump(OP_JUMP_IF_FALSE_LONG);
     emitByte(OP_POP); // Clean up the condition value (as each statement is
                       // required to have zero stack effect).
     statement();
 
-    int elseJumpOffset = emitJump(OP_JUMP);
+    int elseJumpOffset = emitJump(OP_JUMP_LONG);
 
     patchJump(thenJumpOffset);
     emitByte(OP_POP);
@@ -767,7 +1059,7 @@ static void whileStatement()
     expression();
     parser.consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-    int exitJump = emitJump(OP_JUMP_IF_FALSE);
+    int exitJump = emitJump(OP_JUMP_IF_FALSE_LONG);
 
     emitByte(OP_POP);
     statement();
@@ -804,14 +1096,14 @@ static void forStatement()
         parser.consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
 
         // Jump out of the loop if the condition is false.
-        exitJump = emitJump(OP_JUMP_IF_FALSE);
+        exitJump = emitJump(OP_JUMP_IF_FALSE_LONG);
         emitByte(OP_POP); // Condition.
     }
 
     /* increment */
     if (!parser.match(TOKEN_RIGHT_PAREN))
     {
-        int bodyJump = emitJump(OP_JUMP);
+        int bodyJump = emitJump(OP_JUMP_LONG);
 
         int incrementStart = currentChunk()->count();
         expression();
@@ -895,7 +1187,7 @@ static void function(FunctionType type)
                 parser.errorAtCurrent("Can't have more than 255 parameters.");
             }
 
-            uint8_t paramConstant = parseVariable("Expect parameter name.");
+            uint16_t paramConstant = parseVariable("Expect parameter name.");
             defineVariable(paramConstant);
         } while (parser.match(TOKEN_COMMA));
     }
@@ -907,18 +1199,34 @@ static void function(FunctionType type)
 
     // Create the function object.
     ObjFunction* function = endCompiler();
-    emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+    int constant = makeConstant(OBJ_VAL(function));
+
+    // The long form also widens each captured slot index to 16 bits.
+    bool isLong = constant > UINT8_MAX;
+    for (int i = 0; i < function->upvalueCount; i++)
+        if (compiler.upvalues_[i].index > UINT8_MAX) isLong = true;
+
+    if (isLong)
+    {
+        emitByte(OP_CLOSURE_LONG);
+        emitLong((uint32_t)constant);
+    }
+    else
+        emitBytes(OP_CLOSURE, (uint8_t)constant);
 
     for (int i = 0; i < function->upvalueCount; i++)
     {
         emitByte(compiler.upvalues_[i].isLocal ? 1 : 0);
-        emitByte(compiler.upvalues_[i].index);
+        if (isLong)
+            emitShort(compiler.upvalues_[i].index);
+        else
+            emitByte((uint8_t)compiler.upvalues_[i].index);
     }
 }
 
 static void funDeclaration()
 {
-    uint8_t global = parseVariable("Expect function name.");
+    uint16_t global = parseVariable("Expect function name.");
     markInitialized();
     function(TYPE_FUNCTION);
     defineVariable(global);
@@ -927,7 +1235,7 @@ static void funDeclaration()
 static void method()
 {
     parser.consume(TOKEN_IDENTIFIER, "Expect method name.");
-    uint8_t constant = identifierConstant(parser.previous());
+    int constant = identifierConstant(parser.previous());
 
     FunctionType type = TYPE_METHOD;
     if (parser.previous().length == 4 &&
@@ -937,18 +1245,18 @@ static void method()
     }
 
     function(type);
-    emitBytes(OP_METHOD, constant);
+    emitConstantOp(OP_METHOD, OP_METHOD_LONG, constant);
 }
 
 static void classDeclaration()
 {
     parser.consume(TOKEN_IDENTIFIER, "Expect class name.");
     Token className = parser.previous();
-    uint8_t nameConstant = identifierConstant(parser.previous());
+    int nameConstant = identifierConstant(parser.previous());
     declareVariable();
 
-    emitBytes(OP_CLASS, nameConstant);
-    defineVariable(nameConstant);
+    emitConstantOp(OP_CLASS, OP_CLASS_LONG, nameConstant);
+    defineVariable(current->scopeDepth_ > 0 ? 0 : globalSlot(className));
 
     ClassCompiler classCompiler;
     classCompiler.name = parser.previous();
@@ -1034,4 +1342,11 @@ void markCompilerRoots()
     }
 }
 
+void listCompilerRoots(std::vector<ObjFunction*>* functions)
+{
+    for (Compiler* compiler = current; compiler != NULL;
+         compiler = compiler->enclosing_)
+        functions->push_back(compiler->function_);
+}
+
 } // namespace lox
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <iostream>
+#include <unordered_map>
+#include <vector>
 
 #include "chunk.h"
 #include "common.h"
@@ -43,7 +45,7 @@ struct Local
 
 struct Upvalue
 {
-    uint8_t index;
+    uint16_t index;
     bool isLocal;
 };
 
@@ -65,7 +67,8 @@ class Compiler
     void endScope();
     int resolveLocal(const Token& name);
     int resolveUpvalue(const Token& name);
-    int addUpvalue(uint8_t index, bool isLocal);
+    int addUpvalue(uint16_t index, bool isLocal);
+    Local* pushLocal();
 
     /* fields */
     struct Compiler* enclosing_;
@@ -73,10 +76,16 @@ class Compiler
     ObjFunction* function_;
     FunctionType type_;
 
-    Local locals_[UINT8_COUNT];
+    // Grown on demand: a function can have up to UINT16_COUNT of each.
+    std::vector<Local> locals_;
     int localCount_;
     int scopeDepth_;
-    Upvalue upvalues_[UINT8_COUNT];
+    std::vector<Upvalue> upvalues_;
+
+    // Indices of the constants already in function_'s chunk, so each number
+    // (by bit pattern) and interned string is only stored once.
+    std::unordered_map<uint64_t, int> numberConstants_;
+    std::unordered_map<ObjString*, int> stringConstants_;
 };
 
 class ClassCompiler
@@ -89,6 +98,8 @@ class ClassCompiler
 
 ObjFunction* compile(const char* source);
 void markCompilerRoots();
+// The functions markCompilerRoots() marks, innermost first.
+void listCompilerRoots(std::vector<ObjFunction*>* functions);
 
 class Parser
 {
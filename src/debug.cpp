@@ -5,6 +5,7 @@
 
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 
 namespace lox
 {
@@ -25,6 +26,25 @@ static int constantInstruction(const char* name, Chunk* chunk, int offset)
     return offset + 2;
 }
 
+static int constantLongInstruction(const char* name, Chunk* chunk, int offset)
+{
+    uint32_t constant = chunk->readLong(offset + 1);
+    printf("%-16s %4u '", name, constant);
+    printValue(chunk->constants().elems()[constant]);
+    printf("'\n");
+    return offset + 4;
+}
+
+static int globalInstruction(const char* name, Chunk* chunk, int offset)
+{
+    uint16_t slot = (uint16_t)(chunk->code()[offset + 1] << 8);
+    slot |= chunk->code()[offset + 2];
+    printf("%-16s %4d '", name, slot);
+    printValue(vm.globalNames()->elems()[slot]);
+    printf("'\n");
+    return offset + 3;
+}
+
 static int byteInstruction(const char* name, Chunk* chunk, int offset)
 {
     uint8_t slot = chunk->code()[offset + 1];
@@ -32,6 +52,13 @@ static int byteInstruction(const char* name, Chunk* chunk, int offset)
     return offset + 2;
 }
 
+static int shortInstruction(const char* name, Chunk* chunk, int offset)
+{
+    uint16_t slot = chunk->readShort(offset + 1);
+    printf("%-16s %4d\n", name, slot);
+    return offset + 3;
+}
+
 static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset)
 {
     uint16_t jump = (uint16_t)(chunk->code()[offset + 1] << 8);
@@ -40,11 +67,67 @@ static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset)
     return offset + 3;
 }
 
-static int invokeInstruction(const char* name, Chunk* chunk, int offset)
+static int jumpLongInstruction(const char* name, int sign, Chunk* chunk,
+                               int offset)
+{
+    int jump = (int)chunk->readLong(offset + 1);
+    printf("%-16s %4d -> %d\n", name, offset, offset + 4 + sign * jump);
+    return offset + 4;
+}
+
+// The long forms of the property and invoke instructions only differ in
+// having a 24-bit constant index.
+static int propertyInstruction(const char* name, bool isLong, Chunk* chunk,
+                               int offset)
+{
+    uint32_t constant =
+      isLong ? chunk->readLong(offset + 1) : chunk->code()[offset + 1];
+    offset += isLong ? 4 : 2;
+    uint16_t cache = chunk->readShort(offset);
+    printf("%-16s %4u '", name, constant);
+    printValue(chunk->constants().elems()[constant]);
+    printf("' ic %d\n", cache);
+    return offset + 2;
+}
+
+static int invokeInstruction(const char* name, bool isLong, Chunk* chunk,
+                             int offset)
+{
+    uint32_t constant =
+      isLong ? chunk->readLong(offset + 1) : chunk->code()[offset + 1];
+    offset += isLong ? 4 : 2;
+    uint8_t argCount = chunk->code()[offset];
+    uint16_t cache = chunk->readShort(offset + 1);
+    printf("%-16s (%d args) %4u '", name, argCount, constant);
+    printValue(chunk->constants().elems()[constant]);
+    printf("' ic %d\n", cache);
+    return offset + 3;
+}
+
+static int localsInstruction(const char* name, Chunk* chunk, int offset)
+{
+    uint8_t a = chunk->code()[offset + 1];
+    uint8_t b = chunk->code()[offset + 2];
+    printf("%-16s %4d %4d\n", name, a, b);
+    return offset + 3;
+}
+
+static int compareJumpInstruction(const char* name, Chunk* chunk, int offset)
 {
     uint8_t constant = chunk->code()[offset + 1];
-    uint8_t argCount = chunk->code()[offset + 2];
-    printf("%-16s (%d args) %4d '", name, argCount, constant);
+    uint16_t jump = (uint16_t)(chunk->code()[offset + 2] << 8);
+    jump |= chunk->code()[offset + 3];
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants().elems()[constant]);
+    printf("' %d -> %d\n", offset, offset + 4 + jump);
+    return offset + 4;
+}
+
+static int incrementInstruction(const char* name, Chunk* chunk, int offset)
+{
+    uint8_t slot = chunk->code()[offset + 1];
+    uint8_t constant = chunk->code()[offset + 2];
+    printf("%-16s %4d '", name, slot);
     printValue(chunk->constants().elems()[constant]);
     printf("'\n");
     return offset + 3;
@@ -63,10 +146,11 @@ int disassembleInstruction(Chunk* chunk, int offset)
     std::cout << std::setw(4) << std::setfill('0') << offset
               << std::setfill(' ') << " ";
 
-    if (offset > 0 && chunk->lines()[offset] == chunk->lines()[offset - 1])
+    int line = chunk->getLine(offset);
+    if (offset > 0 && line == chunk->getLine(offset - 1))
         std::cout << "   | ";
     else
-        std::cout << std::setw(4) << chunk->lines()[offset] << " ";
+        std::cout << std::setw(4) << line << " ";
 
     uint8_t instruction = chunk->code()[offset];
     switch (instruction)
@@ -88,11 +172,11 @@ int disassembleInstruction(Chunk* chunk, int offset)
         case OP_PRINT: return simpleInstruction("OP_PRINT", offset);
         case OP_POP: return simpleInstruction("OP_POP", offset);
         case OP_GET_GLOBAL:
-            return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+            return globalInstruction("OP_GET_GLOBAL", chunk, offset);
         case OP_DEFINE_GLOBAL:
-            return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+            return globalInstruction("OP_DEFINE_GLOBAL", chunk, offset);
         case OP_SET_GLOBAL:
-            return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+            return globalInstruction("OP_SET_GLOBAL", chunk, offset);
         case OP_RETURN: return simpleInstruction("OP_RETURN", offset);
         case OP_GET_LOCAL:
             return byteInstruction("OP_GET_LOCAL", chunk, offset);
@@ -104,10 +188,14 @@ int disassembleInstruction(Chunk* chunk, int offset)
         case OP_LOOP: return jumpInstruction("OP_LOOP", -1, chunk, offset);
         case OP_CALL: return byteInstruction("OP_CALL", chunk, offset);
         case OP_CLOSURE:
+        case OP_CLOSURE_LONG:
         {
-            offset++;
-            uint8_t constant = chunk->code()[offset++];
-            printf("%-16s %4d ", "OP_CLOSURE", constant);
+            bool isLong = instruction == OP_CLOSURE_LONG;
+            uint32_t constant = isLong ? chunk->readLong(offset + 1)
+                                       : chunk->code()[offset + 1];
+            offset += isLong ? 4 : 2;
+            printf("%-16s %4u ", isLong ? "OP_CLOSURE_LONG" : "OP_CLOSURE",
+                   constant);
             printValue(chunk->constants().elems()[constant]);
             printf("\n");
 
@@ -115,9 +203,12 @@ int disassembleInstruction(Chunk* chunk, int offset)
               AS_FUNCTION(chunk->constants().elems()[constant]);
             for (int j = 0; j < function->upvalueCount; j++)
             {
+                int start = offset;
                 int isLocal = chunk->code()[offset++];
-                int index = chunk->code()[offset++];
-                printf("%04d      |                     %s %d\n", offset - 2,
+                int index = isLong ? chunk->readShort(offset)
+                                   : chunk->code()[offset];
+                offset += isLong ? 2 : 1;
+                printf("%04d      |                     %s %d\n", start,
                        isLocal ? "local" : "upvalue", index);
             }
             return offset;
@@ -130,16 +221,71 @@ int disassembleInstruction(Chunk* chunk, int offset)
             return simpleInstruction("OP_CLOSE_UPVALUE", offset);
         case OP_CLASS: return constantInstruction("OP_CLASS", chunk, offset);
         case OP_GET_PROPERTY:
-            return constantInstruction("OP_GET_PROPERTY", chunk, offset);
+            return propertyInstruction("OP_GET_PROPERTY", false, chunk, offset);
         case OP_SET_PROPERTY:
-            return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+            return propertyInstruction("OP_SET_PROPERTY", false, chunk, offset);
         case OP_METHOD: return constantInstruction("OP_METHOD", chunk, offset);
-        case OP_INVOKE: return invokeInstruction("OP_INVOKE", chunk, offset);
+        case OP_INVOKE:
+            return invokeInstruction("OP_INVOKE", false, chunk, offset);
         case OP_INHERIT: return simpleInstruction("OP_INHERIT", offset);
         case OP_GET_SUPER:
             return constantInstruction("OP_GET_SUPER", chunk, offset);
         case OP_SUPER_INVOKE:
-            return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
+            return invokeInstruction("OP_SUPER_INVOKE", false, chunk, offset);
+        case OP_CONSTANT_LONG:
+            return constantLongInstruction("OP_CONSTANT_LONG", chunk, offset);
+        case OP_GET_LOCAL_LONG:
+            return shortInstruction("OP_GET_LOCAL_LONG", chunk, offset);
+        case OP_SET_LOCAL_LONG:
+            return shortInstruction("OP_SET_LOCAL_LONG", chunk, offset);
+        case OP_JUMP_IF_FALSE_LONG:
+            return jumpLongInstruction("OP_JUMP_IF_FALSE_LONG", 1, chunk,
+                                       offset);
+        case OP_JUMP_LONG:
+            return jumpLongInstruction("OP_JUMP_LONG", 1, chunk, offset);
+        case OP_LOOP_LONG:
+            return jumpLongInstruction("OP_LOOP_LONG", -1, chunk, offset);
+        case OP_GET_UPVALUE_LONG:
+            return shortInstruction("OP_GET_UPVALUE_LONG", chunk, offset);
+        case OP_SET_UPVALUE_LONG:
+            return shortInstruction("OP_SET_UPVALUE_LONG", chunk, offset);
+        case OP_CLASS_LONG:
+            return constantLongInstruction("OP_CLASS_LONG", chunk, offset);
+        case OP_GET_PROPERTY_LONG:
+            return propertyInstruction("OP_GET_PROPERTY_LONG", true, chunk,
+                                       offset);
+        case OP_SET_PROPERTY_LONG:
+            return propertyInstruction("OP_SET_PROPERTY_LONG", true, chunk,
+                                       offset);
+        case OP_METHOD_LONG:
+            return constantLongInstruction("OP_METHOD_LONG", chunk, offset);
+        case OP_INVOKE_LONG:
+            return invokeInstruction("OP_INVOKE_LONG", true, chunk, offset);
+        case OP_GET_SUPER_LONG:
+            return constantLongInstruction("OP_GET_SUPER_LONG", chunk, offset);
+        case OP_SUPER_INVOKE_LONG:
+            return invokeInstruction("OP_SUPER_INVOKE_LONG", true, chunk,
+                                     offset);
+        case OP_ADD_LOCALS:
+            return localsInstruction("OP_ADD_LOCALS", chunk, offset);
+        case OP_SUBTRACT_LOCALS:
+            return localsInstruction("OP_SUBTRACT_LOCALS", chunk, offset);
+        case OP_MULTIPLY_LOCALS:
+            return localsInstruction("OP_MULTIPLY_LOCALS", chunk, offset);
+        case OP_DIVIDE_LOCALS:
+            return localsInstruction("OP_DIVIDE_LOCALS", chunk, offset);
+        case OP_JUMP_IF_LESS:
+            return compareJumpInstruction("OP_JUMP_IF_LESS", chunk, offset);
+        case OP_JUMP_IF_NOT_LESS:
+            return compareJumpInstruction("OP_JUMP_IF_NOT_LESS", chunk,
+                                          offset);
+        case OP_JUMP_IF_GREATER:
+            return compareJumpInstruction("OP_JUMP_IF_GREATER", chunk, offset);
+        case OP_JUMP_IF_NOT_GREATER:
+            return compareJumpInstruction("OP_JUMP_IF_NOT_GREATER", chunk,
+                                          offset);
+        case OP_INCREMENT_LOCAL:
+            return incrementInstruction("OP_INCREMENT_LOCAL", chunk, offset);
         default:
             std::cout << "Unknown opcode " << instruction << std::endl;
             return offset + 1;
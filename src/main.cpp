@@ -1,12 +1,19 @@
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <iostream>
+#include <string>
 
 #include "chunk.h"
 #include "common.h"
+#include "compiler.h"
 #include "debug.h"
+#include "memory.h"
+#include "profiler.h"
+#include "serialize.h"
+#include "snapshot.h"
 #include "vm.h"
 
 using namespace lox;
@@ -59,28 +66,211 @@ static char *readFile(const char *path)
     return buffer;
 }
 
-static void runFile(const char *path)
+static void exitOnError(InterpretResult result)
 {
+    if (result == INTERPRET_COMPILE_ERROR) exit(65);
+    if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+}
+
+// Runs a script, or a .loxc file written by --compile. With useCache, the
+// compiled script is also kept next to the source (path + "c") and reused
+// for as long as the source hashes the same.
+static void runFile(const char *path, bool useCache)
+{
+    if (isBytecodeFile(path, NULL))
+    {
+        ObjFunction *function = loadBytecode(path);
+        if (function == NULL) exit(65);
+        exitOnError(vm.interpret(function));
+        return;
+    }
+
     char *source = readFile(path);
-    InterpretResult result = vm.interpret(source);
+    if (!useCache)
+    {
+        InterpretResult result = vm.interpret(source);
+        free(source);
+        exitOnError(result);
+        return;
+    }
+
+    uint64_t hash = hashSource(source);
+    std::string cachePath = std::string(path) + "c";
+
+    ObjFunction *function = NULL;
+    uint64_t cachedHash;
+    if (isBytecodeFile(cachePath.c_str(), &cachedHash) && cachedHash == hash)
+        function = loadBytecode(cachePath.c_str());
+
+    if (function == NULL)
+    {
+        function = compile(source);
+        if (function == NULL) exit(65);
+        // A cache that can't be written only costs the next run a compile.
+        writeBytecode(cachePath.c_str(), function, hash);
+    }
     free(source);
 
-    if (result == INTERPRET_COMPILE_ERROR) exit(65);
-    if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+    exitOnError(vm.interpret(function));
+}
+
+static void compileFile(const char *outPath, const char *path)
+{
+    char *source = readFile(path);
+    ObjFunction *function = compile(source);
+    if (function == NULL) exit(65);
+
+    if (!writeBytecode(outPath, function, hashSource(source)))
+    {
+        fprintf(stderr, "Could not write file \"%s\".\n", outPath);
+        exit(74);
+    }
+    free(source);
+}
+
+static void usage()
+{
+    fprintf(stderr,
+            "Usage: clox [options] [--cache] [path]\n"
+            "       clox --compile out.loxc path\n"
+            "       clox --heap-report snapshot\n"
+            "\n"
+            "GC options, which override LOX_GC_MAX_HEAP and so on:\n"
+            "  --gc-max-heap=bytes     Keep the heap under this, 0 for no limit.\n"
+            "                          Takes a K, M or G suffix.\n"
+            "  --gc-target-pause=ms    Longest a collection step should take.\n"
+            "  --gc-cpu-fraction=f     Share of the time to spend collecting.\n"
+            "  --gc-concurrent-mark=n  With 1, full collections mark on a\n"
+            "                          thread of their own.\n"
+            "  --gc-compact-threshold=p\n"
+            "                          Compact the heap when that frees p%%\n"
+            "                          of the object slabs, 0 for never.\n"
+            "  --gc-stats=path         Write the collector's counters as JSON\n"
+            "                          to path on exit.\n"
+            "\n"
+            "Profiling options:\n"
+            "  --alloc-profile=path    Write a profile of where memory is\n"
+            "                          allocated to path on exit.\n"
+            "  --alloc-sample=bytes    Sample an allocation about every this\n"
+            "                          many bytes (default %d).\n",
+            ALLOC_SAMPLE_BYTES);
+    exit(64);
+}
+
+// The collector's pacing targets and options, see GCConfig. Each can be set
+// from an environment variable, "max-heap" from LOX_GC_MAX_HEAP and so on.
+static const char *gcOptions[] = {"max-heap", "target-pause", "cpu-fraction",
+                                  "concurrent-mark", "compact-threshold"};
+
+static void readGCEnvironment()
+{
+    for (const char *option : gcOptions)
+    {
+        std::string variable = "LOX_GC_";
+        for (const char *c = option; *c != '\0'; c++)
+            variable += *c == '-' ? '_' : (char)toupper(*c);
+
+        const char *value = getenv(variable.c_str());
+        if (value != NULL && !setGCOption(option, value))
+        {
+            fprintf(stderr, "Invalid %s \"%s\".\n", variable.c_str(), value);
+            exit(64);
+        }
+    }
+}
+
+static const char *gcStatsPath = NULL;
+static const char *allocProfilePath = NULL;
+static size_t allocSampleBytes = ALLOC_SAMPLE_BYTES;
+
+// Also runs on the exits for errors, before the VM is freed.
+static void writeReports()
+{
+    if (gcStatsPath != NULL)
+    {
+        FILE *file = fopen(gcStatsPath, "w");
+        if (file == NULL)
+            fprintf(stderr, "Could not write file \"%s\".\n", gcStatsPath);
+        else
+        {
+            writeGCStats(file, &vm.gcStats());
+            fclose(file);
+        }
+        gcStatsPath = NULL;
+    }
+
+    if (allocProfilePath != NULL)
+    {
+        if (!writeAllocationProfile(allocProfilePath))
+        {
+            fprintf(stderr, "Could not write file \"%s\".\n",
+                    allocProfilePath);
+        }
+        allocProfilePath = NULL;
+    }
+}
+
+// Applies the leading --gc-name=value and --alloc-name=value flags and
+// returns how many there are.
+static int readFlags(int argc, char const *argv[])
+{
+    int count = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        bool isGC = strncmp(argv[i], "--gc-", 5) == 0;
+        if (!isGC && strncmp(argv[i], "--alloc-", 8) != 0) break;
+
+        const char *equals = strchr(argv[i], '=');
+        if (equals == NULL) usage();
+
+        std::string option(argv[i] + 2, equals - argv[i] - 2);
+        const char *value = equals + 1;
+        if (option == "gc-stats")
+            gcStatsPath = value;
+        else if (option == "alloc-profile")
+            allocProfilePath = value;
+        else if (option == "alloc-sample")
+        {
+            char *end;
+            allocSampleBytes = strtoull(value, &end, 10);
+            if (!isdigit((unsigned char)value[0]) || *end != '\0' ||
+                allocSampleBytes == 0)
+                usage();
+        }
+        else if (!isGC || !setGCOption(option.c_str() + 3, value))
+            usage();
+        count++;
+    }
+
+    if (allocProfilePath != NULL) startAllocationProfile(allocSampleBytes);
+    if (gcStatsPath != NULL || allocProfilePath != NULL) atexit(writeReports);
+    return count;
 }
 
 int main(int argc, char const *argv[])
 {
+    readGCEnvironment();
+    int flags = readFlags(argc, argv);
+    argc -= flags;
+    argv += flags;
+
     if (argc == 1)
         repl();
     else if (argc == 2)
-        runFile(argv[1]);
-    else
+        runFile(argv[1], false);
+    else if (argc == 3 && strcmp(argv[1], "--cache") == 0)
+        runFile(argv[2], true);
+    else if (argc == 4 && strcmp(argv[1], "--compile") == 0)
+        compileFile(argv[2], argv[3]);
+    else if (argc == 3 && strcmp(argv[1], "--heap-report") == 0)
     {
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(64);
+        if (!reportHeapSnapshot(argv[2], stdout)) exit(65);
     }
+    else
+        usage();
 
+    writeReports();
     vm.free();
+    unmapBytecode();
     return 0;
 }
@@ -1,44 +1,170 @@
 #include "memory.h"
 
+#include <ctype.h>
+#include <limits.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#include <bit>
+#include <chrono>
+#include <deque>
+#include <vector>
 
+#include "allocator.h"
 #include "compiler.h"
 #include "object.h"
+#include "profiler.h"
 #include "vm.h"
 
 #ifdef DEBUG_LOG_GC
-#include <stdio.h>
-
 #include "debug.h"
 #endif
 
-#define GC_HEAP_GROW_FACTOR 2
+// Under DEBUG_STRESS_GC every allocation runs a young collection or, every
+// this many, starts a full one. A full collection in progress does this much
+// work per allocation instead.
+#define GC_STRESS_FULL_INTERVAL 16
+#define GC_STRESS_STEP_WORK 8
+
+// Objects the marker thread blackens per hold of the heap lock.
+#define GC_MARKER_BATCH 256
+
+// A trace goes parallel once it has blackened this many objects serially.
+#define GC_PARALLEL_THRESHOLD 10000
+
+// A mark worker offers half its gray objects for stealing once it holds this
+// many and none are on offer.
+#define GC_SHARE_THRESHOLD 64
+
+// Objects an allocation sweeps at a time until it has freed as much as it
+// asks for.
+#define GC_SWEEP_BATCH 16
+
+// Fewer reclaimable slabs than this aren't worth compacting the heap for.
+#define GC_COMPACT_MIN_SLABS 4
+
+// Mark steps are never sized below this many objects, whatever the pause
+// target. Steps that trace fewer are too short to time.
+#define GC_MIN_STEP_WORK 100
 
 namespace lox
 {
 
-void* reallocate(void* pointer, size_t oldSize, size_t newSize)
+static void startCollection();
+static void collectGarbageStep(int work);
+static void sweepLazily(size_t bytes);
+
+static uint64_t nanoTime()
 {
-    vm.bytesAllocated_ += newSize - oldSize;
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
 
-    if (newSize > oldSize)
+static void recordPause(uint64_t nanos)
+{
+    gcStats.pauseCount++;
+    gcStats.pauseNanos += nanos;
+    if (nanos > gcStats.maxPauseNanos) gcStats.maxPauseNanos = nanos;
+
+    int bucket = std::bit_width(nanos / 1000);
+    if (bucket >= GC_PAUSE_BUCKETS) bucket = GC_PAUSE_BUCKETS - 1;
+    gcStats.pauseHistogram[bucket]++;
+}
+
+// Full collection work is timed for the pacer, see pace(). Young collections
+// aren't, the nursery size paces those. Each stretch of work is a pause.
+static uint64_t startWork()
+{
+    vm.workStart_ = nanoTime();
+    return vm.workStart_;
+}
+
+static void stopWork(uint64_t start)
+{
+    uint64_t now = nanoTime();
+    vm.workNanos_ += now - vm.workStart_;
+    recordPause(now - start);
+}
+
+// Takes what the blocks really take up, size class rounding included.
+static void countAllocation(size_t oldBytes, size_t newBytes)
+{
+    vm.bytesAllocated_ += newBytes - oldBytes;
+
+    if (newBytes > oldBytes)
     {
+        vm.youngBytes_ += newBytes - oldBytes;
+
 #ifdef DEBUG_STRESS_GC
-        collectGarbage();
+        static int stressCount = 0;
+        if (vm.gcPhase_ != GC_IDLE)
+            collectGarbageStep(GC_STRESS_STEP_WORK);
+        else if (++stressCount % GC_STRESS_FULL_INTERVAL == 0)
+            startCollection();
+        else
+            collectYoungGarbage();
 #endif
 
-        if (vm.bytesAllocated_ > vm.nextGC_) collectGarbage();
+        // Young collections wait while a full collection is in progress.
+        if (vm.gcPhase_ == GC_SWEEP)
+            sweepLazily(newBytes - oldBytes);
+        else if (vm.gcPhase_ != GC_IDLE)
+        {
+            // Past maxHeap, marking is finished at once so that the sweep
+            // can start freeing.
+            vm.stepBytes_ += newBytes - oldBytes;
+            if (gcConfig.maxHeap > 0 && vm.bytesAllocated_ > gcConfig.maxHeap)
+                collectGarbageStep(INT_MAX);
+            else if (vm.stepBytes_ >= vm.stepInterval_)
+                collectGarbageStep(vm.stepWork_);
+        }
+        else if (vm.bytesAllocated_ > vm.nextGC_)
+            startCollection();
+        else if (vm.youngBytes_ > gcConfig.nurserySize)
+            collectYoungGarbage();
     }
+}
+
+void* reallocate(void* pointer, size_t oldSize, size_t newSize)
+{
+    if (newSize > oldSize)
+        profileAllocation(blockSize(newSize) - blockSize(oldSize), -1);
+    countAllocation(blockSize(oldSize), blockSize(newSize));
+    return resizeBlock(pointer, oldSize, newSize);
+}
+
+void* allocateObjectMemory(size_t size)
+{
+    countAllocation(0, objectBlockSize(size));
+    Obj* object = (Obj*)allocateObjectBlock(size);
+
+    // Objects are allocated marked while the marker thread runs, as it won't
+    // visit them, and during the sweep, which must not free them. Otherwise
+    // the block is unmarked already, like any free one.
+    if (vm.gcPhase_ == GC_MARK_CONCURRENT)
+        markBlockAtomic(object);
+    else if (vm.gcPhase_ == GC_SWEEP)
+        markBlock(object);
 
-    if (newSize == 0)
+    if (vm.youngCapacity_ < vm.youngCount_ + 1)
     {
-        free(pointer);
-        return NULL;
+        vm.youngCapacity_ = GROW_CAPACITY(vm.youngCapacity_);
+        // Not managed by the collector, like the gray stack.
+        vm.youngObjects_ = (Obj**)realloc(vm.youngObjects_,
+                                          sizeof(Obj*) * vm.youngCapacity_);
+
+        if (vm.youngObjects_ == NULL) exit(1);
     }
+    vm.youngObjects_[vm.youngCount_++] = object;
+    return object;
+}
 
-    void* result = realloc(pointer, newSize);
-    if (result == NULL) exit(1);
-    return result;
+static void freeObjectMemory(Obj* object)
+{
+    countAllocation(objectBlockSize(object), 0);
+    freeObjectBlock(object);
 }
 
 static void freeObject(Obj* object)
@@ -49,18 +175,13 @@ static void freeObject(Obj* object)
 
     switch (object->type)
     {
-        case OBJ_STRING:
-        {
-            ObjString* string = (ObjString*)object;
-            FREE_ARRAY(char, string->chars, string->length + 1);
-            FREE(ObjString, object);
-            break;
-        }
+        // A string's characters are in its block.
+        case OBJ_STRING: freeObjectMemory(object); break;
         case OBJ_FUNCTION:
         {
             ObjFunction* function = (ObjFunction*)object;
             function->chunk.free();
-            FREE(ObjFunction, object);
+            freeObjectMemory(object);
             // function’s name will be managed by GC
             break;
         }
@@ -72,7 +193,7 @@ static void freeObject(Obj* object)
             // claims any special privilege over it.
             ObjClosure* closure = (ObjClosure*)object;
             FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
-            FREE(ObjClosure, object);
+            freeObjectMemory(object);
             break;
         }
         case OBJ_UPVALUE:
@@ -80,45 +201,113 @@ static void freeObject(Obj* object)
             // Similar to the case of OBJ_CLOSURE, not own the variable it
             // references and free only ObjUpvalue as multiple closures can
             // close over the same variable.
-            FREE(ObjUpvalue, object);
+            freeObjectMemory(object);
             break;
         }
         case OBJ_CLASS:
         {
             ObjClass* klass = (ObjClass*)object;
             freeTable(&klass->methods);
-            FREE(ObjClass, object);
+            freeObjectMemory(object);
             break;
         }
         case OBJ_INSTANCE:
         {
             ObjInstance* instance = (ObjInstance*)object;
-            freeTable(&instance->fields);
-            FREE(ObjInstance, object);
+            FREE_ARRAY(Value, instance->fields,
+                       fieldCapacity(instance->shape->fieldCount));
+            freeObjectMemory(object);
             break;
         }
-        case OBJ_BOUND_METHOD: FREE(ObjBoundMethod, object); break;
+        case OBJ_BOUND_METHOD: freeObjectMemory(object); break;
 
-        case OBJ_NATIVE: FREE(ObjNative, object); break;
+        case OBJ_NATIVE: freeObjectMemory(object); break;
     }
 }
 
+// Frees an object the collector found unreachable.
+static void freeGarbage(Obj* object)
+{
+    ObjTypeStats* stats = &gcStats.types[object->type];
+    stats->freed++;
+    stats->freedBytes += objectBlockSize(object);
+    gcStats.objectsFreed++;
+    freeObject(object);
+}
+
 void freeObjects()
 {
-    Obj* object = vm.objects();
-    while (object != NULL)
+    if (vm.marker_ != NULL)
     {
-        Obj* next = object->next;
-        freeObject(object);
-        object = next;
+        vm.marker_->join();
+        delete vm.marker_;
+        vm.marker_ = NULL;
     }
+
+    BlockCursor cursor = firstObjectBlock();
+    for (Obj* object; (object = (Obj*)nextObjectBlock(&cursor)) != NULL;)
+        freeObject(object);
+    free(vm.youngObjects_);
     free(vm.grayStack_);
+    free(vm.remembered_);
+    free(vm.snapshot_);
+}
+
+// Parallel marking. traceReferences() hands a big trace to
+// gcConfig.markThreads workers, the calling thread being one of them, while
+// the interpreter is stopped. Each worker blackens the objects on its own
+// gray stack. When that runs low it moves half of it to its shared deque, from
+// which idle workers steal. Mark bits are claimed with an atomic exchange so
+// every object is blackened once, and the trace ends when all workers are
+// idle with nothing left to steal.
+struct MarkWorker
+{
+    std::vector<Obj*> gray; // Only touched by the worker itself.
+    std::mutex lock;
+    std::deque<Obj*> shared;
+    std::atomic<size_t> sharedCount{0};
+};
+
+static thread_local MarkWorker* markWorker = NULL;
+static MarkWorker* markWorkers = NULL;
+static int markWorkerCount = 0;
+static std::atomic<int> idleMarkWorkers;
+
+static void markObjectParallel(Obj* object)
+{
+    std::atomic_ref<bool> isOld(object->isOld);
+    if (vm.collectingYoung_ && isOld.load(std::memory_order_relaxed)) return;
+    if (!markBlockAtomic(object)) return;
+
+    // Leave old objects' cache lines clean.
+    if (!isOld.load(std::memory_order_relaxed))
+        isOld.store(true, std::memory_order_relaxed);
+    markWorker->gray.push_back(object);
 }
 
+static void pushGray(Obj* object);
+
 void markObject(Obj* object)
 {
     if (object == NULL) return;
-    if (object->isMarked) return; // To avoid infinite loop.
+    if (markWorker != NULL)
+    {
+        markObjectParallel(object);
+        return;
+    }
+    // A young collection takes every old object to be alive.
+    if (vm.collectingYoung_ && object->isOld) return;
+    if (vm.gcPhase_ == GC_MARK_CONCURRENT)
+    {
+        // The interpreter thread marks the objects it allocates meanwhile,
+        // possibly in the same mark word.
+        if (!markBlockAtomic(object)) return;
+    }
+    else
+    {
+        if (isMarked(object)) return; // To avoid infinite loop.
+        markBlock(object);
+    }
 
 #ifdef DEBUG_LOG_GC
     printf("%p mark ", (void*)object);
@@ -126,8 +315,16 @@ void markObject(Obj* object)
     printf("\n");
 #endif
 
-    object->isMarked = true;
+    // Marked objects are promoted by the sweep, and count as old from now on.
+    // The marker thread leaves isOld alone, which the interpreter thread
+    // reads in writeBarrier(). finishMarking() catches up instead.
+    if (vm.gcPhase_ != GC_MARK_CONCURRENT && !object->isOld)
+        object->isOld = true;
+    pushGray(object);
+}
 
+static void pushGray(Obj* object)
+{
     if (vm.grayCapacity_ < vm.grayCount_ + 1)
     {
         vm.grayCapacity_ = GROW_CAPACITY(vm.grayCapacity_);
@@ -147,6 +344,60 @@ void markValue(Value value)
     markObject(AS_OBJ(value));
 }
 
+void rememberObject(Obj* object)
+{
+    if (!object->isOld || object->isRemembered) return;
+    object->isRemembered = true;
+
+    if (vm.rememberedCapacity_ < vm.rememberedCount_ + 1)
+    {
+        vm.rememberedCapacity_ = GROW_CAPACITY(vm.rememberedCapacity_);
+        // Not managed by the collector either, like the gray stack.
+        vm.remembered_ = (Obj**)realloc(vm.remembered_,
+                                        sizeof(Obj*) * vm.rememberedCapacity_);
+
+        if (vm.remembered_ == NULL) exit(1);
+    }
+    vm.remembered_[vm.rememberedCount_++] = object;
+}
+
+// For stores that may add any number of references to owner, such as copying
+// a method table into it.
+void writeBarrierAll(Obj* owner)
+{
+    rememberObject(owner);
+    // Gray the owner again so marking traces its new references.
+    if (vm.gcPhase_ == GC_MARK && isMarked(owner)) pushGray(owner);
+}
+
+void logSnapshot(Obj* object)
+{
+    if (vm.snapshotCapacity_ < vm.snapshotCount_ + 1)
+    {
+        vm.snapshotCapacity_ = GROW_CAPACITY(vm.snapshotCapacity_);
+        vm.snapshot_ = (Obj**)realloc(vm.snapshot_,
+                                      sizeof(Obj*) * vm.snapshotCapacity_);
+
+        if (vm.snapshot_ == NULL) exit(1);
+    }
+    vm.snapshot_[vm.snapshotCount_++] = object;
+}
+
+// Every collection promotes all young survivors, after which no old object
+// points at a young one.
+static void forgetRemembered()
+{
+    for (int i = 0; i < vm.rememberedCount_; i++)
+        vm.remembered_[i]->isRemembered = false;
+    vm.rememberedCount_ = 0;
+}
+
+static void markArray(ValueArray* array)
+{
+    for (int i = 0; i < array->count(); i++) { markValue(array->elems()[i]); }
+}
+
+// Heap snapshots start from the same roots, see snapshot.cpp.
 static void markRoots()
 {
     for (Value* slot = vm.stack(); slot < vm.stackTop(); slot++)
@@ -159,19 +410,17 @@ static void markRoots()
          upvalue = upvalue->next)
         markObject((Obj*)upvalue);
 
-    markTable(vm.globals());
+    markArray(vm.globalNames());
+    for (int i = 0; i < vm.globalNames()->count(); i++)
+        markValue(vm.globalValues()[i]);
     markCompilerRoots();
+    markShapes();
     markObject((Obj*)vm.initString_);
 }
 
-static void markArray(ValueArray* array)
-{
-    for (int i = 0; i < array->count(); i++) { markValue(array->elems()[i]); }
-}
-
 // Note that we don’t set any state in the traversed object itself. There is no
 // direct encoding of “black” in the object’s state. A black object is any
-// object whose isMarked field is set and that is no longer in the gray stack.
+// object whose mark bit is set and that is no longer in the gray stack.
 static void blackenObject(Obj* object)
 {
 #ifdef DEBUG_LOG_GC
@@ -182,11 +431,13 @@ static void blackenObject(Obj* object)
 
     switch (object->type)
     {
-        case OBJ_UPVALUE: markValue(((ObjUpvalue*)object)->closed); break;
+        case OBJ_UPVALUE:
+            markValue(loadShared(&((ObjUpvalue*)object)->closed));
+            break;
         case OBJ_FUNCTION:
         {
             ObjFunction* function = (ObjFunction*)object;
-            markObject((Obj*)function->name);
+            markObject((Obj*)loadShared(&function->name));
             markArray(function->chunk.constantsPtr());
             break;
         }
@@ -195,7 +446,7 @@ static void blackenObject(Obj* object)
             ObjClosure* closure = (ObjClosure*)object;
             markObject((Obj*)closure->function);
             for (int i = 0; i < closure->upvalueCount; i++)
-                markObject((Obj*)closure->upvalues[i]);
+                markObject((Obj*)loadShared(&closure->upvalues[i]));
             break;
         }
 
@@ -218,7 +469,8 @@ static void blackenObject(Obj* object)
         {
             ObjInstance* instance = (ObjInstance*)object;
             markObject((Obj*)instance->klass);
-            markTable(&instance->fields);
+            for (int i = 0; i < instance->shape->fieldCount; i++)
+                markValue(loadShared(&instance->fields[i]));
             break;
         }
 
@@ -232,62 +484,792 @@ static void blackenObject(Obj* object)
     }
 }
 
+// Takes a gray object from the worker's own stack, or else steals one from
+// any worker's shared deque, its own included.
+static bool takeGray(MarkWorker* self, Obj** object)
+{
+    if (!self->gray.empty())
+    {
+        *object = self->gray.back();
+        self->gray.pop_back();
+        return true;
+    }
+
+    int start = (int)(self - markWorkers);
+    for (int i = 0; i < markWorkerCount; i++)
+    {
+        MarkWorker* victim = &markWorkers[(start + i) % markWorkerCount];
+        if (victim->sharedCount.load(std::memory_order_relaxed) == 0) continue;
+
+        std::lock_guard<std::mutex> guard(victim->lock);
+        if (victim->shared.empty()) continue;
+        *object = victim->shared.front();
+        victim->shared.pop_front();
+        victim->sharedCount.store(victim->shared.size(),
+                                  std::memory_order_relaxed);
+        return true;
+    }
+    return false;
+}
+
+static void shareGray(MarkWorker* self)
+{
+    if (self->gray.size() < GC_SHARE_THRESHOLD ||
+        self->sharedCount.load(std::memory_order_relaxed) > 0)
+        return;
+
+    // The bottom of the stack, which tends to lead to the most work.
+    size_t half = self->gray.size() / 2;
+    std::lock_guard<std::mutex> guard(self->lock);
+    self->shared.insert(self->shared.end(), self->gray.begin(),
+                        self->gray.begin() + half);
+    self->gray.erase(self->gray.begin(), self->gray.begin() + half);
+    self->sharedCount.store(self->shared.size(), std::memory_order_relaxed);
+}
+
+static bool anySharedGray()
+{
+    for (int i = 0; i < markWorkerCount; i++)
+    {
+        if (markWorkers[i].sharedCount.load(std::memory_order_relaxed) > 0)
+            return true;
+    }
+    return false;
+}
+
+static void runMarkWorker(MarkWorker* self)
+{
+    markWorker = self;
+    for (;;)
+    {
+        Obj* object;
+        if (takeGray(self, &object))
+        {
+            blackenObject(object);
+            shareGray(self);
+            continue;
+        }
+
+        // Only busy workers add gray objects, so once every worker is idle
+        // the trace is complete.
+        idleMarkWorkers.fetch_add(1);
+        for (;;)
+        {
+            if (idleMarkWorkers.load() == markWorkerCount)
+            {
+                markWorker = NULL;
+                return;
+            }
+            if (anySharedGray()) break;
+            std::this_thread::yield();
+        }
+        idleMarkWorkers.fetch_sub(1);
+    }
+}
+
+static int markThreadCount()
+{
+    if (gcConfig.markThreads > 0) return gcConfig.markThreads;
+    int count = (int)std::thread::hardware_concurrency();
+    return count > 0 ? count : 1;
+}
+
+static void traceInParallel(int count)
+{
+    markWorkers = new MarkWorker[count];
+    markWorkerCount = count;
+    idleMarkWorkers.store(0);
+
+    for (int i = 0; i < vm.grayCount_; i++)
+        markWorkers[i % count].gray.push_back(vm.grayStack_[i]);
+    vm.grayCount_ = 0;
+
+    std::vector<std::thread> threads;
+    for (int i = 1; i < count; i++)
+        threads.emplace_back(runMarkWorker, &markWorkers[i]);
+    runMarkWorker(&markWorkers[0]);
+    for (std::thread& thread : threads) thread.join();
+
+    delete[] markWorkers;
+    markWorkers = NULL;
+    markWorkerCount = 0;
+}
+
+// Traces everything reachable from the gray stack. Most traces are small
+// and not worth starting threads for, so this starts out serially and only
+// goes parallel once the trace has proved big.
 static void traceReferences()
 {
-    while (vm.grayCount_ > 0)
+    int count = markThreadCount();
+    for (int work = 0; vm.grayCount_ > 0; work++)
     {
+        if (count > 1 && work == GC_PARALLEL_THRESHOLD)
+        {
+            traceInParallel(count);
+            return;
+        }
+
         Obj* object = vm.grayStack_[--vm.grayCount_];
         blackenObject(object);
     }
 }
 
-static void sweep()
+// Old objects in the remembered set are roots of a young collection. They are
+// blackened directly since marking them is a no-op.
+static void markRemembered()
 {
-    Obj* previous = NULL;
-    Obj* object = vm.objects();
-    while (object != NULL)
+    for (int i = 0; i < vm.rememberedCount_; i++)
+        blackenObject(vm.remembered_[i]);
+}
+
+// Frees the young objects that weren't marked. The rest were promoted when
+// they were marked.
+static void sweepYoung()
+{
+    for (int i = 0; i < vm.youngCount_; i++)
     {
-        // If an object is marked (black), leave it alone and continue
-        if (object->isMarked)
+        Obj* object = vm.youngObjects_[i];
+        gcStats.objectsSwept++;
+        if (!isMarked(object))
         {
-            object->isMarked = false; // clear the bit for the next run
-            previous = object;
-            object = object->next;
+            freeGarbage(object);
         }
-        else
+    }
+    vm.youngCount_ = 0;
+}
+
+// Called at the end of each collection and compaction.
+static void recordHeapSize()
+{
+    gcStats.liveBytes = vm.bytesAllocated_;
+    gcStats.heapCommitted = heapCommittedBytes();
+    gcStats.heapResident = heapResidentBytes();
+}
+
+static void recordSweep(uint64_t start, size_t before)
+{
+    uint64_t nanos = nanoTime() - start;
+    gcStats.sweepNanos += nanos;
+    if (nanos > gcStats.maxSweepNanos) gcStats.maxSweepNanos = nanos;
+    gcStats.bytesFreed += before - vm.bytesAllocated_;
+}
+
+// A full collection runs incrementally, a bounded step at a time, so no
+// single allocation pays for the whole heap:
+//  - GC_MARK traces gray objects. writeBarrier() keeps the mutator from
+//    hiding an unmarked object behind a marked one.
+//  - Once the gray stack is empty, finishMarking() rescans the roots, which
+//    have no barrier, and starts the sweep.
+//  - GC_SWEEP walks the object slabs and frees what wasn't marked.
+// Objects allocated while marking start unmarked and survive only if they are
+// reached by the time marking finishes. Objects allocated after that start
+// out marked, which leaves them to the next collection.
+//
+// With gcConfig.concurrentMark, GC_MARK_CONCURRENT replaces GC_MARK: after
+// the roots are marked, a thread of its own traces the gray objects while
+// the interpreter keeps running. It only blackens objects, holding the heap
+// lock. The interpreter meanwhile allocates objects marked, and
+// overwriteBarrier() logs the references it overwrites, so that everything
+// reachable when marking started ends up marked. finishMarking() then only
+// has to trace from the logged references. The marker thread never sweeps or
+// touches the intern table; both wait for it to finish.
+static void markConcurrently()
+{
+    for (;;)
+    {
+        std::lock_guard<std::recursive_mutex> guard(vm.heapLock_);
+        for (int i = 0; i < GC_MARKER_BATCH && vm.grayCount_ > 0; i++)
+            blackenObject(vm.grayStack_[--vm.grayCount_]);
+        if (vm.grayCount_ == 0) break;
+    }
+    vm.markerDone_.store(true, std::memory_order_release);
+}
+
+// The pacer. A full collection costs about the same whenever it runs, as it
+// traces what is live, so the time spent on them is down to how often they
+// run, and that is down to how much the heap may grow in between. pace()
+// measures how fast the heap grew before this collection started and how
+// long the collection took, and lets the heap grow just enough for the next
+// one to take cpuFraction of the time. It measures growth rather than
+// allocation since objects that die young never count towards nextGC_.
+//
+// The limits of GCConfig then apply: heapGrowFactor keeps a big heap from
+// growing without bound when collections are costly, minHeap keeps a small
+// one from being collected all the time when they are cheap, and maxHeap
+// comes before either. Whatever the limits, there is room for at least a
+// nursery's worth of allocation.
+//
+// With concurrentMark, the marker thread's time isn't counted: cpuFraction
+// is the share of the interpreter thread's time.
+static void pace()
+{
+    uint64_t now = nanoTime();
+    size_t live = vm.bytesAllocated_;
+    size_t next = live * gcConfig.heapGrowFactor;
+
+    // The collection being paced is still running, see stopWork().
+    vm.workNanos_ += now - vm.workStart_;
+    vm.workStart_ = now;
+
+    double fraction = gcConfig.cpuFraction;
+    if (fraction > 0 && fraction < 1 && vm.idleStart_ != 0 &&
+        vm.idleNanos_ > 0 && vm.idleGrowth_ > 0)
+    {
+        double growthPerNano = (double)vm.idleGrowth_ / vm.idleNanos_;
+        double idleNanos = vm.workNanos_ * (1 - fraction) / fraction;
+        double growth = growthPerNano * idleNanos;
+        if (growth < (double)(next - live)) next = live + (size_t)growth;
+    }
+
+    if (next < gcConfig.minHeap) next = gcConfig.minHeap;
+    if (gcConfig.maxHeap > 0 && next > gcConfig.maxHeap)
+        next = gcConfig.maxHeap;
+    if (next < live + gcConfig.nurserySize) next = live + gcConfig.nurserySize;
+
+    vm.nextGC_ = next;
+    vm.liveBytes_ = live;
+    vm.idleStart_ = now;
+    vm.workNanos_ = 0;
+}
+
+// Sizes the mark steps for gcConfig.targetPause, given a step that took
+// nanos to blacken count objects.
+static void paceSteps(uint64_t nanos, int count)
+{
+    if (count < GC_MIN_STEP_WORK) return;
+
+    double objectNanos = (double)nanos / count;
+    vm.markObjectNanos_ = vm.markObjectNanos_ == 0
+                            ? objectNanos
+                            : (vm.markObjectNanos_ * 3 + objectNanos) / 4;
+    if (gcConfig.targetPause == 0) return;
+
+    double work = gcConfig.targetPause / vm.markObjectNanos_;
+    vm.stepWork_ = work < GC_MIN_STEP_WORK ? GC_MIN_STEP_WORK
+                   : work > INT_MAX / 2    ? INT_MAX / 2
+                                           : (int)work;
+    vm.stepInterval_ =
+      (size_t)((double)gcConfig.stepBytes * vm.stepWork_ / gcConfig.stepWork);
+}
+
+bool setGCOption(const char* name, const char* value)
+{
+    if (!isdigit((unsigned char)value[0]) && value[0] != '.') return false;
+
+    char* end;
+    if (strcmp(name, "max-heap") == 0)
+    {
+        size_t bytes = strtoull(value, &end, 10);
+        switch (*end)
+        {
+            case 'K': bytes <<= 10; end++; break;
+            case 'M': bytes <<= 20; end++; break;
+            case 'G': bytes <<= 30; end++; break;
+        }
+        if (end == value || *end != '\0') return false;
+
+        gcConfig.maxHeap = bytes;
+        if (bytes > 0 && vm.nextGC_ > bytes) vm.nextGC_ = bytes;
+        return true;
+    }
+
+    double number = strtod(value, &end);
+    if (end == value || *end != '\0') return false;
+
+    if (strcmp(name, "target-pause") == 0)
+    {
+        gcConfig.targetPause = (uint64_t)(number * 1000000);
+        return true;
+    }
+    if (strcmp(name, "cpu-fraction") == 0 && number < 1)
+    {
+        gcConfig.cpuFraction = number;
+        return true;
+    }
+    // Not in the middle of a concurrent mark, whose marker relies on
+    // HeapLock being taken.
+    if (strcmp(name, "concurrent-mark") == 0 && (number == 0 || number == 1) &&
+        vm.gcPhase_ != GC_MARK_CONCURRENT)
+    {
+        gcConfig.concurrentMark = number == 1;
+        return true;
+    }
+    if (strcmp(name, "compact-threshold") == 0 && number <= 100 &&
+        number == (int)number)
+    {
+        gcConfig.compactThreshold = (int)number;
+        return true;
+    }
+    return false;
+}
+
+static void startCollection()
+{
+#ifdef DEBUG_LOG_GC
+    printf("-- gc begin at %zu bytes\n", vm.bytesAllocated_);
+#endif
+
+    uint64_t start = startWork();
+    if (vm.idleStart_ != 0)
+    {
+        vm.idleNanos_ = vm.workStart_ - vm.idleStart_;
+        vm.idleGrowth_ = vm.bytesAllocated_ > vm.liveBytes_
+                           ? vm.bytesAllocated_ - vm.liveBytes_
+                           : 0;
+    }
+    if (gcConfig.targetPause == 0)
+    {
+        vm.stepWork_ = gcConfig.stepWork;
+        vm.stepInterval_ = gcConfig.stepBytes;
+    }
+
+    vm.gcPhase_ = GC_MARK;
+    vm.stepBytes_ = 0;
+    vm.compactPending_ = false;
+    clearMarks();
+    markRoots();
+
+    if (gcConfig.concurrentMark)
+    {
+        vm.gcPhase_ = GC_MARK_CONCURRENT;
+        vm.markerDone_.store(false, std::memory_order_relaxed);
+        vm.marker_ = new std::thread(markConcurrently);
+    }
+    stopWork(start);
+}
+
+static void finishMarking()
+{
+    if (vm.gcPhase_ == GC_MARK_CONCURRENT)
+    {
+        vm.marker_->join();
+        delete vm.marker_;
+        vm.marker_ = NULL;
+        vm.gcPhase_ = GC_MARK;
+
+        for (int i = 0; i < vm.snapshotCount_; i++)
+            markObject(vm.snapshot_[i]);
+        vm.snapshotCount_ = 0;
+        traceReferences();
+
+        for (int i = 0; i < vm.youngCount_; i++)
+        {
+            Obj* object = vm.youngObjects_[i];
+            if (isMarked(object)) object->isOld = true;
+        }
+    }
+
+    markRoots();
+    traceReferences();
+    tableRemoveWhite(vm.strings(), false);
+    forgetRemembered(); // Before the sweep frees remembered objects.
+
+    // Each young object is now either marked, and so old, or garbage the
+    // sweep will free.
+    vm.youngCount_ = 0;
+    vm.youngBytes_ = 0;
+    vm.sweepCursor_ = firstObjectBlock();
+    vm.gcPhase_ = GC_SWEEP;
+}
+
+static void finishCollection()
+{
+    // The young objects were all allocated during the sweep, and so marked.
+    // Young collections expect them unmarked.
+    for (int i = 0; i < vm.youngCount_; i++) unmarkBlock(vm.youngObjects_[i]);
+
+    releaseEmptySlabs();
+    recordHeapSize();
+    vm.gcPhase_ = GC_IDLE;
+    pace();
+    gcStats.fullCollections++;
+
+    // Objects can only be moved where the interpreter holds no pointers to
+    // them in C++ locals, so the compaction waits for a safepoint in run().
+    int slabCount;
+    int reclaimable = reclaimableSlabs(&slabCount);
+    if (gcConfig.compactThreshold > 0 && reclaimable >= GC_COMPACT_MIN_SLABS &&
+        reclaimable * 100 >= slabCount * gcConfig.compactThreshold)
+        vm.compactPending_ = true;
+
+#ifdef DEBUG_LOG_GC
+    printf("-- gc end at %zu bytes, next at %zu\n", vm.bytesAllocated_,
+           vm.nextGC_);
+    printf("   swept %zu objects in %llu ns so far\n", gcStats.objectsSwept,
+           (unsigned long long)gcStats.sweepNanos);
+#endif
+}
+
+// Sweeps up to work objects, freeing the unmarked ones.
+static void sweepStep(int work)
+{
+    uint64_t start = nanoTime();
+    size_t before = vm.bytesAllocated_;
+
+    bool done = false;
+    for (; work > 0; work--)
+    {
+        Obj* object = (Obj*)nextObjectBlock(&vm.sweepCursor_);
+        if (object == NULL)
+        {
+            done = true;
+            break;
+        }
+
+        gcStats.objectsSwept++;
+        if (!isMarked(object))
+        {
+            freeGarbage(object);
+        }
+    }
+
+    recordSweep(start, before);
+    if (done) finishCollection();
+}
+
+// The sweep is paid for by allocation. Before an allocation of bytes takes
+// new memory, it sweeps until it has freed about as much, or until it has
+// swept gcConfig.sweepWork objects.
+static void sweepLazily(size_t bytes)
+{
+    uint64_t start = startWork();
+    size_t before = vm.bytesAllocated_;
+    for (int work = 0; work < gcConfig.sweepWork; work += GC_SWEEP_BATCH)
+    {
+        if (vm.gcPhase_ != GC_SWEEP) break;
+        if (before - vm.bytesAllocated_ >= bytes) break;
+        sweepStep(GC_SWEEP_BATCH);
+    }
+    stopWork(start);
+}
+
+// Does up to work objects' worth of the full collection in progress.
+static void collectGarbageStep(int work)
+{
+    uint64_t start = startWork();
+    vm.stepBytes_ = 0;
+
+    switch (vm.gcPhase_)
+    {
+        case GC_IDLE: break;
+        case GC_MARK:
         {
-            //  If it is unmarked (white), unlink it from the list and free it.
-            Obj* unreached = object;
-            object = object->next;
-            if (previous != NULL)
-                previous->next = object;
-            else
-                vm.objects_ = object;
-
-            freeObject(unreached);
+            if (work == INT_MAX) traceReferences();
+            int count = 0;
+            for (; count < work && vm.grayCount_ > 0; count++)
+                blackenObject(vm.grayStack_[--vm.grayCount_]);
+            paceSteps(nanoTime() - vm.workStart_, count);
+            if (vm.grayCount_ == 0) finishMarking();
+            break;
         }
+        case GC_MARK_CONCURRENT:
+            // Waiting for the marker thread while holding the heap lock it
+            // needs would deadlock.
+            if (vm.heapLockDepth_ > 0) break;
+            if (work == INT_MAX || vm.markerDone_.load(std::memory_order_acquire))
+                finishMarking();
+            break;
+        case GC_SWEEP: sweepStep(work); break;
     }
+    stopWork(start);
 }
 
+// Runs a whole full collection at once, after finishing any in progress.
 void collectGarbage()
+{
+    while (vm.gcPhase_ != GC_IDLE) collectGarbageStep(INT_MAX);
+
+    startCollection();
+    while (vm.gcPhase_ != GC_IDLE) collectGarbageStep(INT_MAX);
+}
+
+// A young collection only traces and sweeps objects allocated since the last
+// collection, starting from the roots and the remembered set. Most objects die
+// young, so this reclaims most garbage without visiting the old objects.
+// nextGC_ is left alone: it is the promoted bytes that decide when the next
+// full collection runs.
+void collectYoungGarbage()
 {
 #ifdef DEBUG_LOG_GC
-    printf("-- gc begin\n");
+    printf("-- young gc begin\n");
     size_t before = vm.bytesAllocated_;
 #endif
 
+    uint64_t pauseStart = nanoTime();
+    vm.collectingYoung_ = true;
     markRoots();
+    markRemembered();
     traceReferences();
-    tableRemoveWhite(vm.strings());
-    sweep();
+    tableRemoveWhite(vm.strings(), true);
+
+    uint64_t start = nanoTime();
+    size_t swept = vm.bytesAllocated_;
+    sweepYoung();
+    recordSweep(start, swept);
+
+    forgetRemembered();
+    vm.collectingYoung_ = false;
+
+    releaseEmptySlabs();
+    recordHeapSize();
+    vm.youngBytes_ = 0;
+    gcStats.youngCollections++;
+    recordPause(nanoTime() - pauseStart);
+
+#ifdef DEBUG_LOG_GC
+    printf("-- young gc end\n");
+    printf("   collected %zu bytes (from %zu to %zu)\n",
+           before - vm.bytesAllocated_, before, vm.bytesAllocated_);
+#endif
+}
+
+// Heap compaction. Long-running programs leave object slabs sparsely used
+// once most of what they held has died, and since objects never move
+// otherwise the slabs stay. Compaction moves the objects of the sparsest slabs
+// into the free blocks of the others and gives the emptied slabs back.
+//
+// Only the objects themselves move, strings with the characters they hold
+// inline. The arrays objects own (code, constants, fields, table entries)
+// stay where they are, so the frames' ip and the interpreter's cached
+// constants remain valid. Every reference to an object gets forwarded: the
+// roots, the young objects, the remembered set and each object's own
+// references. Inline caches are flushed rather than forwarded, since a stale
+// entry may point at a closure that is long gone.
+
+static void forwardArray(ValueArray* array)
+{
+    for (int i = 0; i < array->count(); i++) forwardValue(&array->elems()[i]);
+}
+
+static void forwardRoots()
+{
+    for (Value* slot = vm.stack(); slot < vm.stackTop(); slot++)
+        forwardValue(slot);
+
+    for (int i = 0; i < vm.frameCount(); i++)
+    {
+        CallFrame* frame = &vm.frames()[i];
+        frame->closure = (ObjClosure*)forwardObject((Obj*)frame->closure);
+    }
+
+    vm.openUpvalues_ = (ObjUpvalue*)forwardObject((Obj*)vm.openUpvalues_);
+    forwardArray(vm.globalNames());
+    for (int i = 0; i < vm.globalNames()->count(); i++)
+        forwardValue(&vm.globalValues()[i]);
+    forwardTable(&vm.globalSlots_);
+    forwardTable(vm.strings());
+    forwardShapes();
+    vm.initString_ = (ObjString*)forwardObject((Obj*)vm.initString_);
+
+    for (int i = 0; i < vm.youngCount_; i++)
+        vm.youngObjects_[i] = forwardObject(vm.youngObjects_[i]);
+    for (int i = 0; i < vm.rememberedCount_; i++)
+        vm.remembered_[i] = forwardObject(vm.remembered_[i]);
+}
+
+static void forwardReferences(Obj* object)
+{
+    switch (object->type)
+    {
+        case OBJ_UPVALUE:
+        {
+            ObjUpvalue* upvalue = (ObjUpvalue*)object;
+            forwardValue(&upvalue->closed);
+            // Only open upvalues are on the list.
+            if (upvalue->location != &upvalue->closed)
+            {
+                upvalue->next =
+                  (ObjUpvalue*)forwardObject((Obj*)upvalue->next);
+            }
+            break;
+        }
+        case OBJ_FUNCTION:
+        {
+            ObjFunction* function = (ObjFunction*)object;
+            function->name = (ObjString*)forwardObject((Obj*)function->name);
+            forwardArray(function->chunk.constantsPtr());
+            if (function->chunk.cacheCount() > 0)
+            {
+                memset(function->chunk.caches(), 0,
+                       sizeof(InlineCache) * function->chunk.cacheCount());
+            }
+            break;
+        }
+        case OBJ_CLOSURE:
+        {
+            ObjClosure* closure = (ObjClosure*)object;
+            closure->function =
+              (ObjFunction*)forwardObject((Obj*)closure->function);
+            for (int i = 0; i < closure->upvalueCount; i++)
+            {
+                closure->upvalues[i] =
+                  (ObjUpvalue*)forwardObject((Obj*)closure->upvalues[i]);
+            }
+            break;
+        }
+        case OBJ_NATIVE:
+        case OBJ_STRING: break;
+        case OBJ_CLASS:
+        {
+            ObjClass* klass = (ObjClass*)object;
+            klass->name = (ObjString*)forwardObject((Obj*)klass->name);
+            forwardTable(&klass->methods);
+            break;
+        }
+        case OBJ_INSTANCE:
+        {
+            ObjInstance* instance = (ObjInstance*)object;
+            instance->klass = (ObjClass*)forwardObject((Obj*)instance->klass);
+            for (int i = 0; i < instance->shape->fieldCount; i++)
+                forwardValue(&instance->fields[i]);
+            break;
+        }
+        case OBJ_BOUND_METHOD:
+        {
+            ObjBoundMethod* bound = (ObjBoundMethod*)object;
+            forwardValue(&bound->receiver);
+            bound->method = (ObjClosure*)forwardObject((Obj*)bound->method);
+            break;
+        }
+    }
+}
+
+// Copies the objects in slabs being evacuated, leaving a pointer to the
+// copy in place of each original.
+static void evacuateObjects()
+{
+    BlockCursor cursor = firstObjectBlock();
+    for (Obj* object; (object = (Obj*)nextObjectBlock(&cursor)) != NULL;)
+    {
+        if (!isEvacuating(object)) continue;
+
+        Obj* copy = (Obj*)evacuateBlock(object);
+        // A closed upvalue points into itself.
+        if (object->type == OBJ_UPVALUE &&
+            ((ObjUpvalue*)object)->location == &((ObjUpvalue*)object)->closed)
+            ((ObjUpvalue*)copy)->location = &((ObjUpvalue*)copy)->closed;
+
+        *(Obj**)object = copy;
+        gcStats.objectsMoved++;
+    }
+}
+
+// Must only be called with no pointers to objects outside the heap and the
+// VM's roots, see VM::run(). Does nothing while a collection is in progress.
+void compactHeap()
+{
+    vm.compactPending_ = false;
+    if (vm.gcPhase_ != GC_IDLE) return;
+    uint64_t start = startWork();
+
+#ifdef DEBUG_LOG_GC
+    printf("-- compact begin at %zu bytes\n", vm.bytesAllocated_);
+#endif
 
-    vm.nextGC_ = vm.bytesAllocated_ * GC_HEAP_GROW_FACTOR;
+    if (startEvacuation() > 0)
+    {
+        evacuateObjects();
+        forwardRoots();
+
+        BlockCursor cursor = firstObjectBlock();
+        for (Obj* object; (object = (Obj*)nextObjectBlock(&cursor)) != NULL;)
+        {
+            if (!isEvacuating(object)) forwardReferences(object);
+        }
+    }
+    finishEvacuation();
+    recordHeapSize();
+    gcStats.compactions++;
+    stopWork(start);
 
 #ifdef DEBUG_LOG_GC
-    printf("-- gc end\n");
-    printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
-           before - vm.bytesAllocated_, before, vm.bytesAllocated_, vm.nextGC_);
+    printf("-- compact end, %zu objects moved so far\n", gcStats.objectsMoved);
 #endif
 }
 
+static const char* typeNames[] = {"strings",  "functions", "natives",
+                                  "closures", "upvalues",  "classes",
+                                  "instances", "boundMethods"};
+static_assert(sizeof(typeNames) / sizeof(typeNames[0]) == OBJ_TYPE_COUNT,
+              "every object type needs a name");
+
+void visitGCStats(const GCStats* stats, GCStatVisitor visit, void* context)
+{
+#define VISIT(counter) visit(context, NULL, #counter, (double)stats->counter)
+    VISIT(youngCollections);
+    VISIT(fullCollections);
+    VISIT(objectsSwept);
+    VISIT(objectsFreed);
+    VISIT(bytesFreed);
+    VISIT(sweepNanos);
+    VISIT(maxSweepNanos);
+    VISIT(compactions);
+    VISIT(objectsMoved);
+    VISIT(pauseCount);
+    VISIT(pauseNanos);
+    VISIT(maxPauseNanos);
+    VISIT(liveBytes);
+    VISIT(heapCommitted);
+    VISIT(heapResident);
+    VISIT(internedStrings);
+    VISIT(internTableBytes);
+#undef VISIT
+
+    char name[32];
+    for (int i = 0; i < GC_PAUSE_BUCKETS; i++)
+    {
+        if (i < GC_PAUSE_BUCKETS - 1)
+            snprintf(name, sizeof(name), "under%dus", 1 << i);
+        else
+            snprintf(name, sizeof(name), "longer");
+        visit(context, "pauseHistogram", name,
+              (double)stats->pauseHistogram[i]);
+    }
+
+    for (int i = 0; i < OBJ_TYPE_COUNT; i++)
+    {
+        const ObjTypeStats* type = &stats->types[i];
+        visit(context, typeNames[i], "allocated", (double)type->allocated);
+        visit(context, typeNames[i], "allocatedBytes",
+              (double)type->allocatedBytes);
+        visit(context, typeNames[i], "freed", (double)type->freed);
+        visit(context, typeNames[i], "freedBytes", (double)type->freedBytes);
+    }
+}
+
+struct JSONWriter
+{
+    FILE* file;
+    const char* group; // Of the last counter written.
+    bool first;        // Nothing written in the current object yet.
+};
+
+static void writeGCStat(void* context, const char* group, const char* name,
+                        double value)
+{
+    JSONWriter* writer = (JSONWriter*)context;
+    if (group != NULL &&
+        (writer->group == NULL || strcmp(group, writer->group) != 0))
+    {
+        if (writer->group != NULL) fprintf(writer->file, "\n  }");
+        fprintf(writer->file, ",\n  \"%s\": {", group);
+        writer->group = group;
+        writer->first = true;
+    }
+
+    const char* indent = group != NULL ? "    " : "  ";
+    fprintf(writer->file, "%s\n%s\"%s\": %.0f", writer->first ? "" : ",",
+            indent, name, value);
+    writer->first = false;
+}
+
+void writeGCStats(FILE* file, const GCStats* stats)
+{
+    JSONWriter writer = {file, NULL, true};
+    fprintf(file, "{");
+    visitGCStats(stats, writeGCStat, &writer);
+    if (writer.group != NULL) fprintf(file, "\n  }");
+    fprintf(file, "\n}\n");
+}
+
 } // namespace lox
@@ -1,7 +1,13 @@
 #pragma once
 
+#include <stdio.h>
+
+#include <atomic>
+
+#include "allocator.h"
 #include "common.h"
 #include "object.h"
+#include "vm.h"
 
 #define GROW_CAPACITY(capacity) ((capacity) < 8 ? 8 : (capacity)*2)
 
@@ -16,14 +22,252 @@
 
 #define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
 
+#define GC_HEAP_GROW_FACTOR 2
+#define GC_MIN_HEAP (1024 * 1024)
+#define GC_MAX_HEAP 0
+#define GC_TARGET_PAUSE 200000
+#define GC_CPU_FRACTION 0.1
+#define GC_NURSERY_SIZE (256 * 1024)
+#define GC_STEP_BYTES (32 * 1024)
+#define GC_STEP_WORK 1000
+#define GC_CONCURRENT_MARK false
+#define GC_MARK_THREADS 0
+#define GC_SWEEP_WORK 256
+#define GC_COMPACT_THRESHOLD 25
+
+#define GC_PAUSE_BUCKETS 16
+
 namespace lox
 {
 
+// Collector tuning. The pacer (see pace() in memory.cpp) picks the heap size
+// at which the next full collection starts so that full collections take
+// about cpuFraction of the running time, 0 leaving it to heapGrowFactor
+// alone. The heap may grow to heapGrowFactor times what is live, but not past
+// maxHeap (0 meaning no limit), and it isn't collected before it reaches
+// minHeap. maxHeap is a soft limit: with more than that live, full
+// collections run as often as young ones.
+//
+// Once a full collection starts, it runs a mark step every stepBytes
+// allocated until marking is done, each marking stepWork objects to begin
+// with. The pacer then sizes the steps so that each takes about targetPause
+// nanoseconds (0 keeping stepWork), spacing them out in proportion so that
+// marking keeps the same pace. If that pace is too slow for the allocation
+// rate the heap grows past nextGC_ before the collection catches up. With
+// concurrentMark, marking runs on a thread of its own instead.
+//
+// The sweep is done lazily by allocations, each sweeping at most sweepWork
+// objects.
+//
+// Tracing with the interpreter stopped, as young collections and the end of
+// a full one do, spreads big traces over markThreads threads, 0 meaning one
+// per hardware thread.
+//
+// After a full collection, the heap is compacted if moving objects would
+// give back at least compactThreshold percent of the object slabs, 0
+// meaning never.
+struct GCConfig
+{
+    int heapGrowFactor; // Full collection at this multiple of the live heap.
+    size_t nurserySize; // Bytes allocated between young collections.
+    size_t stepBytes;
+    int stepWork;
+    bool concurrentMark;
+    int markThreads;
+    int sweepWork;
+    int compactThreshold;
+    size_t minHeap;
+    size_t maxHeap;
+    uint64_t targetPause; // In nanoseconds.
+    double cpuFraction;
+};
+
+inline GCConfig gcConfig = {GC_HEAP_GROW_FACTOR, GC_NURSERY_SIZE,
+                            GC_STEP_BYTES,       GC_STEP_WORK,
+                            GC_CONCURRENT_MARK,  GC_MARK_THREADS,
+                            GC_SWEEP_WORK,       GC_COMPACT_THRESHOLD,
+                            GC_MIN_HEAP,         GC_MAX_HEAP,
+                            GC_TARGET_PAUSE,     GC_CPU_FRACTION};
+
+// Sets a pacing target or option from text, as given on the command line or
+// in the environment: "max-heap" (bytes, with an optional K, M or G suffix),
+// "target-pause" (milliseconds), "cpu-fraction" (between 0 and 1),
+// "concurrent-mark" (0 or 1) or "compact-threshold" (a percentage, 0 for
+// never). Returns false if the name or the value isn't valid.
+bool setGCOption(const char* name, const char* value);
+
+// Objects of a type allocated, and freed by the collector, with the bytes
+// their blocks take up. The arrays they own aren't counted.
+struct ObjTypeStats
+{
+    size_t allocated;
+    size_t allocatedBytes;
+    size_t freed;
+    size_t freedBytes;
+};
+
+// Running totals since startup, except for the heap sizes, which are as of
+// the end of the last collection (see heapCommittedBytes()), and the intern
+// table's, which VM::gcStats() fills in.
+//
+// A pause is a stretch of collector work on the interpreter thread: a young
+// collection, a step of a full one, or a compaction. Pause i of the
+// histogram counts the pauses shorter than 2^i microseconds but not shorter
+// than 2^(i-1), and the last one the rest.
+struct GCStats
+{
+    size_t youngCollections;
+    size_t fullCollections;
+    size_t objectsSwept;
+    size_t objectsFreed;
+    size_t bytesFreed;
+    uint64_t sweepNanos;    // Time spent sweeping.
+    uint64_t maxSweepNanos; // Longest single sweep.
+    size_t compactions;
+    size_t objectsMoved;
+    size_t pauseCount;
+    uint64_t pauseNanos;
+    uint64_t maxPauseNanos;
+    size_t pauseHistogram[GC_PAUSE_BUCKETS];
+    size_t liveBytes; // Bytes allocated after the last collection.
+    size_t heapCommitted;
+    size_t heapResident;
+    size_t internedStrings;
+    size_t internTableBytes;
+    ObjTypeStats types[OBJ_TYPE_COUNT];
+};
+
+inline GCStats gcStats;
+
+// Calls visit with each counter of stats and its name. The pause histogram
+// and the counters of each object type come in groups, named
+// "pauseHistogram" and "strings", "functions" and so on. Other counters have
+// no group.
+typedef void (*GCStatVisitor)(void* context, const char* group,
+                              const char* name, double value);
+void visitGCStats(const GCStats* stats, GCStatVisitor visit, void* context);
+
+// Writes stats as a JSON object.
+void writeGCStats(FILE* file, const GCStats* stats);
+
+// Held by the interpreter thread while it reallocates an array the marker
+// thread reads (instance fields, tables and value arrays), so the marker never
+// sees one half moved. The marker takes it while blackening. Only taken when
+// concurrent marking is enabled.
+class HeapLock
+{
+  public:
+    HeapLock() : locked_(gcConfig.concurrentMark)
+    {
+        if (!locked_) return;
+        vm.heapLock_.lock();
+        vm.heapLockDepth_++;
+    }
+    ~HeapLock()
+    {
+        if (!locked_) return;
+        vm.heapLockDepth_--;
+        vm.heapLock_.unlock();
+    }
+
+  private:
+    bool locked_;
+};
+
+// Single slots the marker thread reads while the interpreter stores to them,
+// with no lock held: instance fields, closed upvalues, table entries, and the
+// references filled into a closure or function after it is allocated. The
+// interpreter stores with storeShared() and the marker loads with
+// loadShared(). Relaxed ordering is enough, because the barriers log whatever
+// the marker misses and finishMarking() traces it.
+template <typename T> inline T loadShared(const T* slot)
+{
+    return std::atomic_ref<T>(*const_cast<T*>(slot))
+      .load(std::memory_order_relaxed);
+}
+
+template <typename T> inline void storeShared(T* slot, T value)
+{
+    std::atomic_ref<T>(*slot).store(value, std::memory_order_relaxed);
+}
+
+#ifndef NAN_BOXING
+// A two-word Value has no lock-free atomic access, so the union
+// representation still races with the marker.
+inline Value loadShared(const Value* slot) { return *slot; }
+inline void storeShared(Value* slot, Value value) { *slot = value; }
+#endif
+
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
+void* allocateObjectMemory(size_t size);
 void freeObjects();
 
 void collectGarbage();
+void collectYoungGarbage();
+void compactHeap();
+
+// Mark bits live in the slab headers, see allocator.h. Marks set by a young
+// collection on the objects it promotes stay set until the next full
+// collection clears them all when it starts.
+inline bool isMarked(Obj* object)
+{
+    return isBlockMarked(object);
+}
+
 void markObject(Obj* object);
 void markValue(Value value);
+void rememberObject(Obj* object);
+void writeBarrierAll(Obj* owner);
+void logSnapshot(Obj* object);
+
+// Call after storing target into owner, unless owner was allocated after
+// target and nothing has been allocated since.
+//  - A young collection only traces old objects through the remembered set,
+//    so an old owner pointing at a young target must be in it.
+//  - While a full collection is marking, a marked owner won't be traced
+//    again, so an unmarked target gets marked here (a Dijkstra barrier).
+inline void writeBarrier(Obj* owner, Obj* target)
+{
+    if (target == NULL) return;
+    if (owner->isOld && !target->isOld) rememberObject(owner);
+    if (vm.gcPhase_ == GC_MARK && isMarked(owner) && !isMarked(target))
+        markObject(target);
+}
+
+inline void writeBarrier(Obj* owner, Value value)
+{
+    if (IS_OBJ(value)) writeBarrier(owner, AS_OBJ(value));
+}
+
+// Call before a heap object's reference to old is overwritten. A concurrent
+// collection marks everything reachable when it started, and the marker
+// thread may not have followed this reference yet (a snapshot-at-the-beginning
+// barrier).
+inline void overwriteBarrier(Value old)
+{
+    if (vm.gcPhase_ == GC_MARK_CONCURRENT && IS_OBJ(old))
+        logSnapshot(AS_OBJ(old));
+}
+
+// Call when a weak reference hands out object, which may be unmarked garbage
+// that has just become reachable again.
+inline void weakReadBarrier(Obj* object)
+{
+    if (vm.gcPhase_ == GC_MARK_CONCURRENT) logSnapshot(object);
+}
+
+// Call on every reference to an object while compactHeap() moves objects. An
+// object in a slab being evacuated has been copied, and what is left of it
+// points to the copy.
+inline Obj* forwardObject(Obj* object)
+{
+    if (object == NULL || !isEvacuating(object)) return object;
+    return *(Obj**)object;
+}
+
+inline void forwardValue(Value* value)
+{
+    if (IS_OBJ(*value)) *value = OBJ_VAL(forwardObject(AS_OBJ(*value)));
+}
 
 } // namespace lox
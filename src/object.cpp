@@ -4,6 +4,7 @@
 #include <string.h>
 
 #include "memory.h"
+#include "profiler.h"
 #include "table.h"
 #include "value.h"
 #include "vm.h"
@@ -14,14 +15,29 @@
 namespace lox
 {
 
+// Objects must come from slabs, which is where their mark bits are.
+static_assert(sizeof(ObjString) <= SLAB_MAX_BLOCK &&
+                sizeof(ObjFunction) <= SLAB_MAX_BLOCK &&
+                sizeof(ObjNative) <= SLAB_MAX_BLOCK &&
+                sizeof(ObjClosure) <= SLAB_MAX_BLOCK &&
+                sizeof(ObjUpvalue) <= SLAB_MAX_BLOCK &&
+                sizeof(ObjClass) <= SLAB_MAX_BLOCK &&
+                sizeof(ObjInstance) <= SLAB_MAX_BLOCK &&
+                sizeof(ObjBoundMethod) <= SLAB_MAX_BLOCK,
+              "objects must fit in a slab block");
+
 static Obj* allocateObject(size_t size, ObjType type)
 {
-    Obj* object = (Obj*)reallocate(NULL, 0, size);
+    Obj* object = (Obj*)allocateObjectMemory(size);
     object->type = type;
-    object->isMarked = false;
+    object->isOld = false;
+    object->isRemembered = false;
 
-    object->next = vm.objects();
-    vm.objects_ = object;
+    size_t bytes = objectBlockSize(object);
+    ObjTypeStats* stats = &gcStats.types[type];
+    stats->allocated++;
+    stats->allocatedBytes += bytes;
+    profileAllocation(bytes, type);
 
 #ifdef DEBUG_LOG_GC
     printf("%p allocate %zu for %d\n", (void*)object, size, type);
@@ -30,13 +46,17 @@ static Obj* allocateObject(size_t size, ObjType type)
     return object;
 }
 
-static ObjString* allocateString(char* chars, int length, uint32_t hash)
+ObjString* newString(int length)
 {
-    ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+    ObjString* string = (ObjString*)allocateObject(
+      sizeof(ObjString) + length + 1, OBJ_STRING);
     string->length = length;
-    string->chars = chars;
-    string->hash = hash;
+    string->chars[length] = '\0';
+    return string;
+}
 
+static ObjString* internString(ObjString* string)
+{
     vm.push(OBJ_VAL(string)); // For GC
     tableSet(vm.strings(), string, NIL_VAL);
     vm.pop();
@@ -60,26 +80,30 @@ ObjString* copyString(const char* chars, int length)
 {
     uint32_t hash = hashString(chars, length);
     ObjString* interned = tableFindString(vm.strings(), chars, length, hash);
-    if (interned != NULL) return interned;
-
-    char* heapChars = ALLOCATE(char, length + 1);
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0';
+    if (interned != NULL)
+    {
+        weakReadBarrier((Obj*)interned);
+        return interned;
+    }
 
-    return allocateString(heapChars, length, hash);
+    ObjString* string = newString(length);
+    memcpy(string->chars, chars, length);
+    string->hash = hash;
+    return internString(string);
 }
 
-ObjString* takeString(char* chars, int length)
+ObjString* takeString(ObjString* string)
 {
-    uint32_t hash = hashString(chars, length);
-    ObjString* interned = tableFindString(vm.strings(), chars, length, hash);
+    string->hash = hashString(string->chars, string->length);
+    ObjString* interned = tableFindString(vm.strings(), string->chars,
+                                          string->length, string->hash);
     if (interned != NULL)
     {
-        FREE_ARRAY(char, chars, length + 1);
+        weakReadBarrier((Obj*)interned);
         return interned;
     }
 
-    return allocateString(chars, length, hash);
+    return internString(string);
 }
 
 ObjClosure* newClosure(ObjFunction* function)
@@ -102,6 +126,7 @@ ObjFunction* newFunction()
     function->name = NULL;
     function->chunk.init();
     function->upvalueCount = 0;
+    function->slotCount = 1;
     return function;
 }
 
@@ -126,6 +151,8 @@ ObjClass* newClass(ObjString* name)
     ObjClass* klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
     klass->name = name;
     initTable(&klass->methods);
+    klass->id = vm.nextClassId_++;
+    klass->serial = klass->id;
     return klass;
 }
 
@@ -133,10 +160,61 @@ ObjInstance* newInstance(ObjClass* klass)
 {
     ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
     instance->klass = klass;
-    initTable(&instance->fields);
+    instance->shape = vm.rootShape_;
+    instance->fields = NULL;
     return instance;
 }
 
+int fieldCapacity(int fieldCount)
+{
+    if (fieldCount == 0) return 0;
+
+    int capacity = 4;
+    while (capacity < fieldCount) capacity *= 2;
+    return capacity;
+}
+
+// Moves instance to shape, a descendant of its current one, growing the field
+// array as needed. New slots start out as nil.
+void setInstanceShape(ObjInstance* instance, Shape* shape)
+{
+    HeapLock lock;
+    int oldCapacity = fieldCapacity(instance->shape->fieldCount);
+    int capacity = fieldCapacity(shape->fieldCount);
+    if (capacity > oldCapacity)
+    {
+        instance->fields =
+          GROW_ARRAY(Value, instance->fields, oldCapacity, capacity);
+    }
+
+    for (int i = instance->shape->fieldCount; i < shape->fieldCount; i++)
+        instance->fields[i] = NIL_VAL;
+    instance->shape = shape;
+}
+
+bool instanceGetField(ObjInstance* instance, ObjString* name, Value* value)
+{
+    int slot = shapeFindSlot(instance->shape, name);
+    if (slot == -1) return false;
+
+    *value = instance->fields[slot];
+    return true;
+}
+
+void instanceSetField(ObjInstance* instance, ObjString* name, Value value)
+{
+    int slot = shapeFindSlot(instance->shape, name);
+    if (slot == -1)
+    {
+        Shape* shape = shapeAddField(instance->shape, name);
+        setInstanceShape(instance, shape);
+        slot = shape->slot;
+    }
+    overwriteBarrier(instance->fields[slot]);
+    storeShared(&instance->fields[slot], value);
+    writeBarrier((Obj*)instance, value);
+}
+
 ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method)
 {
     ObjBoundMethod* bound = ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD);
@@ -156,6 +234,16 @@ static void printFunction(ObjFunction* function)
     printf("<fn %s>", function->name->chars);
 }
 
+const char* objTypeName(ObjType type)
+{
+    static const char* names[] = {"string",   "function", "native",
+                                  "closure",  "upvalue",  "class",
+                                  "instance", "boundMethod"};
+    static_assert(sizeof(names) / sizeof(names[0]) == OBJ_TYPE_COUNT,
+                  "every object type needs a name");
+    return names[type];
+}
+
 void printObject(Value value)
 {
     switch (OBJ_TYPE(value))
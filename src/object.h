@@ -2,6 +2,7 @@
 
 #include "chunk.h"
 #include "common.h"
+#include "shape.h"
 #include "table.h"
 #include "value.h"
 
@@ -39,11 +40,13 @@ typedef enum
     OBJ_BOUND_METHOD
 } ObjType;
 
+#define OBJ_TYPE_COUNT (OBJ_BOUND_METHOD + 1)
+
 struct Obj
 {
     ObjType type;
-    bool isMarked;
-    struct Obj* next;
+    bool isOld;        // Survived a collection, see collectYoungGarbage().
+    bool isRemembered; // In the remembered set.
 };
 
 struct ObjFunction
@@ -53,6 +56,7 @@ struct ObjFunction
     Chunk chunk;
     ObjString* name;
     int upvalueCount;
+    int slotCount; // Stack slots a call takes, the callee's included.
 };
 
 struct ObjUpvalue
@@ -79,12 +83,14 @@ struct ObjNative
     NativeFn function;
 };
 
+// The characters follow the header in the same block, with a '\0' after
+// them.
 struct ObjString
 {
     Obj obj;
     int length;
-    char* chars;
     uint32_t hash;
+    char chars[];
 };
 
 struct ObjClass
@@ -92,13 +98,21 @@ struct ObjClass
     Obj obj;
     ObjString* name;
     Table methods;
+    // Key for inline caches. Reassigned whenever methods changes.
+    uint64_t id;
+    // The id the class was created with, which stays with it. It lets a
+    // cache entry tell that it was filled for an earlier id of this class.
+    uint64_t serial;
 };
 
+// Field values live in a flat array indexed by the slots of shape. Its
+// capacity is derived from shape->fieldCount (see fieldCapacity()).
 struct ObjInstance
 {
     Obj obj;
     ObjClass* klass;
-    Table fields;
+    Shape* shape;
+    Value* fields;
 };
 
 struct ObjBoundMethod
@@ -114,11 +128,22 @@ ObjClosure* newClosure(ObjFunction* function);
 ObjFunction* newFunction();
 ObjNative* newNative(NativeFn function);
 ObjString* copyString(const char* chars, int length);
-ObjString* takeString(char* chars, int length);
+// Allocates a string of length characters for the caller to fill in and
+// pass to takeString(), keeping it reachable in between.
+ObjString* newString(int length);
+// Interns string and returns it, or returns the equal string that was
+// interned already and leaves string to the collector.
+ObjString* takeString(ObjString* string);
 ObjUpvalue* newUpvalue(Value* slot);
 ObjInstance* newInstance(ObjClass* klass);
 
+int fieldCapacity(int fieldCount);
+void setInstanceShape(ObjInstance* instance, Shape* shape);
+bool instanceGetField(ObjInstance* instance, ObjString* name, Value* value);
+void instanceSetField(ObjInstance* instance, ObjString* name, Value value);
+
 void printObject(Value value);
+const char* objTypeName(ObjType type);
 
 static inline bool isObjType(Value value, ObjType type)
 {
@@ -0,0 +1,72 @@
+// This file is intentionally missing an include guard. It is an X-macro list
+// of every opcode in encoding order: define OPCODE(name) before including it.
+// chunk.h uses it to build the OpCode enum and vm.cpp to build the threaded
+// dispatch table, so the two can never get out of sync.
+
+OPCODE(OP_RETURN)
+OPCODE(OP_NOT)
+OPCODE(OP_NEGATE)
+OPCODE(OP_CONSTANT)
+OPCODE(OP_ADD)
+OPCODE(OP_SUBTRACT)
+OPCODE(OP_MULTIPLY)
+OPCODE(OP_DIVIDE)
+OPCODE(OP_NIL)
+OPCODE(OP_TRUE)
+OPCODE(OP_FALSE)
+OPCODE(OP_EQUAL)
+OPCODE(OP_GREATER)
+OPCODE(OP_LESS)
+OPCODE(OP_PRINT)
+OPCODE(OP_POP)
+OPCODE(OP_DEFINE_GLOBAL)
+OPCODE(OP_GET_GLOBAL)
+OPCODE(OP_SET_GLOBAL)
+OPCODE(OP_GET_LOCAL)
+OPCODE(OP_SET_LOCAL)
+OPCODE(OP_JUMP_IF_FALSE)
+OPCODE(OP_JUMP)
+OPCODE(OP_LOOP)
+OPCODE(OP_CALL)
+OPCODE(OP_CLOSURE)
+OPCODE(OP_GET_UPVALUE)
+OPCODE(OP_SET_UPVALUE)
+OPCODE(OP_CLOSE_UPVALUE)
+OPCODE(OP_CLASS)
+OPCODE(OP_GET_PROPERTY)
+OPCODE(OP_SET_PROPERTY)
+OPCODE(OP_METHOD)
+OPCODE(OP_INVOKE)
+OPCODE(OP_INHERIT)
+OPCODE(OP_GET_SUPER)
+OPCODE(OP_SUPER_INVOKE)
+
+// Wide forms of the above for operands that outgrow a byte (a 24-bit
+// constant index or jump offset, or a 16-bit local or upvalue slot).
+OPCODE(OP_CONSTANT_LONG)
+OPCODE(OP_GET_LOCAL_LONG)
+OPCODE(OP_SET_LOCAL_LONG)
+OPCODE(OP_JUMP_IF_FALSE_LONG)
+OPCODE(OP_JUMP_LONG)
+OPCODE(OP_LOOP_LONG)
+OPCODE(OP_CLOSURE_LONG)
+OPCODE(OP_GET_UPVALUE_LONG)
+OPCODE(OP_SET_UPVALUE_LONG)
+OPCODE(OP_CLASS_LONG)
+OPCODE(OP_GET_PROPERTY_LONG)
+OPCODE(OP_SET_PROPERTY_LONG)
+OPCODE(OP_METHOD_LONG)
+OPCODE(OP_INVOKE_LONG)
+OPCODE(OP_GET_SUPER_LONG)
+OPCODE(OP_SUPER_INVOKE_LONG)
+
+// Superinstructions, only produced by the peephole pass in optimizer.cpp.
+OPCODE(OP_ADD_LOCALS)
+OPCODE(OP_SUBTRACT_LOCALS)
+OPCODE(OP_MULTIPLY_LOCALS)
+OPCODE(OP_DIVIDE_LOCALS)
+OPCODE(OP_JUMP_IF_LESS)
+OPCODE(OP_JUMP_IF_NOT_LESS)
+OPCODE(OP_JUMP_IF_GREATER)
+OPCODE(OP_JUMP_IF_NOT_GREATER)
+OPCODE(OP_INCREMENT_LOCAL)
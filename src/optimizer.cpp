@@ -0,0 +1,319 @@
+#include "optimizer.h"
+
+#include <vector>
+
+#include "object.h"
+#include "value.h"
+
+// Peephole pass run over every chunk once the compiler is done with it. It
+// fuses the sequences the single-pass compiler emits for the most common
+// statements into superinstructions:
+//
+//   GET_LOCAL a; GET_LOCAL b; ADD            -> ADD_LOCALS a b
+//     (likewise SUBTRACT, MULTIPLY and DIVIDE)
+//   CONSTANT k; LESS; JUMP_IF_FALSE t; POP   -> JUMP_IF_NOT_LESS k t'
+//   CONSTANT k; LESS; NOT; JUMP_IF_FALSE t; POP
+//                                            -> JUMP_IF_LESS k t'
+//     (likewise GREATER), where t is an OP_POP and t' the instruction after
+//     it: the fused form pops the condition itself on both paths.
+//   GET_LOCAL s; CONSTANT k; ADD; SET_LOCAL s; POP
+//                                            -> INCREMENT_LOCAL s k
+//     for a number k.
+//
+// A sequence is only fused when no jump lands inside it. The pass also
+// narrows the long jumps the compiler emits for every forward branch. The
+// code only ever shrinks, so a jump whose distance fit in 16 bits before the
+// rewrite still does after it.
+
+namespace lox
+{
+
+namespace
+{
+
+struct Instruction
+{
+    int offset;
+    int size;
+};
+
+struct Jump
+{
+    int operand; // Offset of the jump operand in the new code.
+    int end;     // Offset just past the new instruction.
+    int target;  // Old offset of the target instruction.
+    bool backward;
+    bool isLong; // 24-bit rather than 16-bit operand.
+};
+
+class Optimizer
+{
+  public:
+    Optimizer(Chunk* chunk) : chunk_(chunk), code_(chunk->code()) {}
+
+    void run();
+
+  private:
+    void decode();
+    uint8_t op(int i) const { return code_[instructions_[i].offset]; }
+    uint8_t operand(int i, int n = 1) const
+    {
+        return code_[instructions_[i].offset + n];
+    }
+    int jumpDistance(int i) const;
+    int jumpTarget(int i) const;
+    bool fusible(int i, int count) const;
+    bool isNumberConstant(int i) const;
+
+    int tryLocalsArithmetic(int i);
+    int tryCompareJump(int i);
+    int tryIncrementLocal(int i);
+
+    void emit(uint8_t byte, int line);
+    void emitJump(uint8_t op, uint8_t constant, int distance, int target,
+                  int line);
+
+    Chunk* chunk_;
+    const uint8_t* code_;
+    std::vector<Instruction> instructions_;
+    std::vector<bool> isTarget_;
+
+    std::vector<uint8_t> newCode_;
+    std::vector<int> newLines_;
+    std::vector<int> newOffsets_; // Old instruction offset -> new offset.
+    std::vector<Jump> jumps_;
+};
+
+void Optimizer::decode()
+{
+    int count = chunk_->count();
+    isTarget_.assign(count + 1, false);
+
+    for (int offset = 0; offset < count;)
+    {
+        int size = chunk_->instructionSize(offset);
+        instructions_.push_back({offset, size});
+        offset += size;
+    }
+
+    for (int i = 0; i < (int)instructions_.size(); i++)
+    {
+        switch (op(i))
+        {
+            case OP_JUMP:
+            case OP_JUMP_IF_FALSE:
+            case OP_LOOP:
+            case OP_JUMP_LONG:
+            case OP_JUMP_IF_FALSE_LONG:
+            case OP_LOOP_LONG: isTarget_[jumpTarget(i)] = true; break;
+            default: break;
+        }
+    }
+}
+
+int Optimizer::jumpDistance(int i) const
+{
+    int offset = instructions_[i].offset;
+    switch (op(i))
+    {
+        case OP_JUMP_LONG:
+        case OP_JUMP_IF_FALSE_LONG:
+        case OP_LOOP_LONG: return chunk_->readLong(offset + 1);
+        default: return chunk_->readShort(offset + 1);
+    }
+}
+
+int Optimizer::jumpTarget(int i) const
+{
+    const Instruction& instruction = instructions_[i];
+    int end = instruction.offset + instruction.size;
+    bool backward = op(i) == OP_LOOP || op(i) == OP_LOOP_LONG;
+    return backward ? end - jumpDistance(i) : end + jumpDistance(i);
+}
+
+// Whether the count instructions starting at i exist and no jump lands on any
+// of them but the first.
+bool Optimizer::fusible(int i, int count) const
+{
+    if (i + count > (int)instructions_.size()) return false;
+
+    for (int j = i + 1; j < i + count; j++)
+        if (isTarget_[instructions_[j].offset]) return false;
+    return true;
+}
+
+bool Optimizer::isNumberConstant(int i) const
+{
+    return op(i) == OP_CONSTANT &&
+           IS_NUMBER(chunk_->constants().elems()[operand(i)]);
+}
+
+void Optimizer::emit(uint8_t byte, int line)
+{
+    newCode_.push_back(byte);
+    newLines_.push_back(line);
+}
+
+// Emits a jump to the old offset target, patched once the new offsets are
+// known. distance is the jump's length in the old code and picks the form.
+void Optimizer::emitJump(uint8_t op, uint8_t constant, int distance,
+                         int target, int line)
+{
+    bool isLong = distance > UINT16_MAX;
+    bool backward = false;
+    switch (op)
+    {
+        case OP_JUMP:
+        case OP_JUMP_LONG: emit(isLong ? OP_JUMP_LONG : OP_JUMP, line); break;
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_FALSE_LONG:
+            emit(isLong ? OP_JUMP_IF_FALSE_LONG : OP_JUMP_IF_FALSE, line);
+            break;
+        case OP_LOOP:
+        case OP_LOOP_LONG:
+            emit(isLong ? OP_LOOP_LONG : OP_LOOP, line);
+            backward = true;
+            break;
+        default:
+            // A compare-and-branch, which only comes in the short form.
+            emit(op, line);
+            emit(constant, line);
+            break;
+    }
+
+    int operand = (int)newCode_.size();
+    for (int i = isLong ? 3 : 2; i > 0; i--) emit(0xff, line);
+    jumps_.push_back({operand, (int)newCode_.size(), target, backward, isLong});
+}
+
+int Optimizer::tryLocalsArithmetic(int i)
+{
+    if (!fusible(i, 3) || op(i) != OP_GET_LOCAL || op(i + 1) != OP_GET_LOCAL)
+        return 0;
+
+    uint8_t fused;
+    switch (op(i + 2))
+    {
+        case OP_ADD: fused = OP_ADD_LOCALS; break;
+        case OP_SUBTRACT: fused = OP_SUBTRACT_LOCALS; break;
+        case OP_MULTIPLY: fused = OP_MULTIPLY_LOCALS; break;
+        case OP_DIVIDE: fused = OP_DIVIDE_LOCALS; break;
+        default: return 0;
+    }
+
+    int line = chunk_->getLine(instructions_[i].offset);
+    emit(fused, line);
+    emit(operand(i), line);
+    emit(operand(i + 1), line);
+    return 3;
+}
+
+int Optimizer::tryCompareJump(int i)
+{
+    if (!fusible(i, 4) || op(i) != OP_CONSTANT) return 0;
+
+    uint8_t compare = op(i + 1);
+    if (compare != OP_LESS && compare != OP_GREATER) return 0;
+
+    // NOT flips which outcome of the comparison takes the jump.
+    bool negated = op(i + 2) == OP_NOT;
+    int jump = negated ? i + 3 : i + 2;
+    if (!fusible(i, negated ? 5 : 4) ||
+        (op(jump) != OP_JUMP_IF_FALSE && op(jump) != OP_JUMP_IF_FALSE_LONG) ||
+        op(jump + 1) != OP_POP)
+        return 0;
+
+    // Both paths have to pop the condition for the fused form to drop it.
+    int target = jumpTarget(jump);
+    if (target >= chunk_->count() || code_[target] != OP_POP) return 0;
+
+    // The fused form only has a 16-bit offset.
+    int distance = jumpDistance(jump) + 1;
+    if (distance > UINT16_MAX) return 0;
+
+    uint8_t fused;
+    if (compare == OP_LESS)
+        fused = negated ? OP_JUMP_IF_LESS : OP_JUMP_IF_NOT_LESS;
+    else
+        fused = negated ? OP_JUMP_IF_GREATER : OP_JUMP_IF_NOT_GREATER;
+
+    emitJump(fused, operand(i), distance, target + 1,
+             chunk_->getLine(instructions_[i].offset));
+    return negated ? 5 : 4;
+}
+
+int Optimizer::tryIncrementLocal(int i)
+{
+    if (!fusible(i, 5) || op(i) != OP_GET_LOCAL || !isNumberConstant(i + 1) ||
+        op(i + 2) != OP_ADD || op(i + 3) != OP_SET_LOCAL ||
+        operand(i + 3) != operand(i) || op(i + 4) != OP_POP)
+        return 0;
+
+    int line = chunk_->getLine(instructions_[i].offset);
+    emit(OP_INCREMENT_LOCAL, line);
+    emit(operand(i), line);
+    emit(operand(i + 1), line);
+    return 5;
+}
+
+void Optimizer::run()
+{
+    decode();
+    newOffsets_.assign(chunk_->count() + 1, -1);
+
+    for (int i = 0; i < (int)instructions_.size();)
+    {
+        const Instruction& instruction = instructions_[i];
+        newOffsets_[instruction.offset] = (int)newCode_.size();
+
+        int fused = tryIncrementLocal(i);
+        if (fused == 0) fused = tryLocalsArithmetic(i);
+        if (fused == 0) fused = tryCompareJump(i);
+        if (fused > 0)
+        {
+            i += fused;
+            continue;
+        }
+
+        int line = chunk_->getLine(instruction.offset);
+        switch (op(i))
+        {
+            case OP_JUMP:
+            case OP_JUMP_IF_FALSE:
+            case OP_LOOP:
+            case OP_JUMP_LONG:
+            case OP_JUMP_IF_FALSE_LONG:
+            case OP_LOOP_LONG:
+                emitJump(op(i), 0, jumpDistance(i), jumpTarget(i), line);
+                break;
+            default:
+                for (int j = 0; j < instruction.size; j++)
+                    emit(code_[instruction.offset + j], line);
+                break;
+        }
+        i++;
+    }
+    newOffsets_[chunk_->count()] = (int)newCode_.size();
+
+    for (const Jump& jump : jumps_)
+    {
+        int target = newOffsets_[jump.target];
+        int distance = jump.backward ? jump.end - target : target - jump.end;
+        int operand = jump.operand;
+        if (jump.isLong) newCode_[operand++] = (distance >> 16) & 0xff;
+        newCode_[operand] = (distance >> 8) & 0xff;
+        newCode_[operand + 1] = distance & 0xff;
+    }
+
+    chunk_->rewrite((int)newCode_.size(), newCode_.data(), newLines_.data());
+}
+
+} // namespace
+
+void optimizeChunk(Chunk* chunk)
+{
+    Optimizer optimizer(chunk);
+    optimizer.run();
+}
+
+} // namespace lox
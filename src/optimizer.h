@@ -0,0 +1,10 @@
+#pragma once
+
+#include "chunk.h"
+
+namespace lox
+{
+
+void optimizeChunk(Chunk* chunk);
+
+} // namespace lox
@@ -0,0 +1,81 @@
+#include "profiler.h"
+
+#include <math.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "object.h"
+#include "vm.h"
+
+namespace lox
+{
+
+static double meanSampleBytes;
+static std::minstd_rand sampleRandom;
+static std::unordered_map<std::string, double> stackBytes;
+
+// The gaps between samples are drawn from an exponential distribution, so
+// that allocation patterns that repeat every so many bytes can't line up
+// with them.
+static int64_t nextSampleGap()
+{
+    std::exponential_distribution<double> gaps(1 / meanSampleBytes);
+    return (int64_t)gaps(sampleRandom) + 1;
+}
+
+void startAllocationProfile(size_t sampleBytes)
+{
+    meanSampleBytes = (double)sampleBytes;
+    bytesUntilSample = nextSampleGap();
+}
+
+void sampleAllocation(size_t bytes, int type)
+{
+    bytesUntilSample = nextSampleGap();
+
+    // The chance that an allocation of bytes is sampled is
+    // 1 - exp(-bytes / mean), so each sample stands for bytes divided by
+    // that.
+    double weight = bytes / -expm1(-(double)bytes / meanSampleBytes);
+
+    std::string stack;
+    if (vm.frameCount() == 0) stack = "(compiler);";
+    for (int i = 0; i < vm.frameCount(); i++)
+    {
+        CallFrame* frame = &vm.frames()[i];
+        ObjFunction* function = frame->closure->function;
+        int offset = (int)(frame->ip - function->chunk.code()) - 1;
+
+        stack += function->name == NULL ? "script" : function->name->chars;
+        stack += ':';
+        stack += std::to_string(function->chunk.getLine(std::max(offset, 0)));
+        stack += ';';
+    }
+    stack += '(';
+    stack += type < 0 ? "array" : objTypeName((ObjType)type);
+    stack += ')';
+
+    stackBytes[stack] += weight;
+}
+
+bool writeAllocationProfile(const char* path)
+{
+    FILE* file = fopen(path, "w");
+    if (file == NULL) return false;
+
+    std::vector<std::pair<std::string, double>> stacks(stackBytes.begin(),
+                                                       stackBytes.end());
+    std::sort(stacks.begin(), stacks.end());
+    for (auto& [stack, bytes] : stacks)
+        fprintf(file, "%s %.0f\n", stack.c_str(), bytes);
+
+    bool written = !ferror(file);
+    return fclose(file) == 0 && written;
+}
+
+} // namespace lox
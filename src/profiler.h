@@ -0,0 +1,42 @@
+#pragma once
+
+#include "common.h"
+
+#define ALLOC_SAMPLE_BYTES (64 * 1024)
+
+namespace lox
+{
+
+// Sampling allocation profiler. Once started, it samples about one
+// allocation in every sampleBytes bytes allocated, recording the call stack
+// and what was allocated: an object of some type, or an array owned by one.
+// Each sample stands for the bytes the allocations it was picked from are
+// estimated to add up to. The profile is written in the folded stack format
+// that flamegraph.pl and most profile viewers take, a line per stack:
+//
+//   script:12;makeList:4;(instance) 1572864
+//
+// The stack reads from the outermost call in, each frame a function and the
+// line it was at. It needs frames' ip to be current whenever something is
+// allocated, which VM::run() makes sure of for the collector's sake.
+
+// Bytes left to allocate before the next sample. Never reached while the
+// profiler is off.
+inline int64_t bytesUntilSample = INT64_MAX;
+
+void startAllocationProfile(size_t sampleBytes);
+
+// type is an ObjType, or -1 for an array.
+void sampleAllocation(size_t bytes, int type);
+
+// Call for every allocation of bytes.
+inline void profileAllocation(size_t bytes, int type)
+{
+    bytesUntilSample -= (int64_t)bytes;
+    if (bytesUntilSample < 0) sampleAllocation(bytes, type);
+}
+
+// Returns false if path can't be written.
+bool writeAllocationProfile(const char* path);
+
+} // namespace lox
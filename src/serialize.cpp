@@ -0,0 +1,696 @@
+#include "serialize.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "chunk.h"
+#include "memory.h"
+#include "vm.h"
+
+// File layout, all integers little-endian:
+//
+//   header    "LOXC", u32 version, u32 opcode count, u64 source hash
+//   globals   u32 count, then each global name as a string, in slot order
+//   function  the top-level script
+//
+//   function  u32 arity, u32 upvalue count, u32 slot count,
+//             u32 inline cache count, u8 has name, [string name],
+//             u32 code length, code bytes,
+//             u32 line run count, (u32 offset, u32 line) per run,
+//             u32 constant count, constants
+//   constant  u8 tag, then a u64 number, a string or a nested function
+//   string    u32 length, bytes
+//
+// The code refers to globals by slot, so a file can only be run by a VM that
+// assigns the same slots to the same names: the loader checks that.
+//
+// The code is run as it is, so the loader verifies it first: that the code
+// decodes into whole instructions, each property and invoke instruction with
+// an inline cache of its own, that the operands of every instruction
+// reachable from the start index constants of the right type, globals,
+// locals and upvalues that exist, that jumps land on an instruction with the
+// stack as high as on every other way there, and that no instruction pops
+// more than the frame holds or runs off the end.
+
+namespace lox
+{
+
+#define BYTECODE_MAGIC "LOXC"
+#define BYTECODE_VERSION 1
+#define HEADER_SIZE 20
+
+// Deepest nesting of functions a file may have, which bounds the recursion
+// of readFunction().
+#define FUNCTION_DEPTH_MAX 256
+
+// Opcodes are numbered by their position in opcodes.h, so a file is only
+// readable by a build with the same list. Its length is a cheap check.
+static const uint32_t opcodeCount = 0
+#define OPCODE(name) +1
+#include "opcodes.h"
+#undef OPCODE
+  ;
+
+typedef enum
+{
+    CONSTANT_NUMBER,
+    CONSTANT_STRING,
+    CONSTANT_FUNCTION,
+} ConstantTag;
+
+struct Mapping
+{
+    void* address;
+    size_t size;
+};
+
+static std::vector<Mapping> mappings;
+
+uint64_t hashSource(const char* source)
+{
+    // 64-bit FNV-1a.
+    uint64_t hash = 14695981039346656037ull;
+    for (const char* c = source; *c != '\0'; c++)
+    {
+        hash ^= (uint8_t)*c;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+/* writing */
+
+static void writeU8(std::vector<uint8_t>& out, uint8_t value)
+{
+    out.push_back(value);
+}
+
+static void writeU32(std::vector<uint8_t>& out, uint32_t value)
+{
+    for (int i = 0; i < 4; i++) out.push_back((value >> (8 * i)) & 0xff);
+}
+
+static void writeU64(std::vector<uint8_t>& out, uint64_t value)
+{
+    for (int i = 0; i < 8; i++) out.push_back((value >> (8 * i)) & 0xff);
+}
+
+static void writeString(std::vector<uint8_t>& out, ObjString* string)
+{
+    writeU32(out, (uint32_t)string->length);
+    out.insert(out.end(), string->chars, string->chars + string->length);
+}
+
+static void writeFunction(std::vector<uint8_t>& out, ObjFunction* function)
+{
+    Chunk* chunk = &function->chunk;
+
+    writeU32(out, (uint32_t)function->arity);
+    writeU32(out, (uint32_t)function->upvalueCount);
+    writeU32(out, (uint32_t)function->slotCount);
+    writeU32(out, (uint32_t)chunk->cacheCount());
+    writeU8(out, function->name != NULL);
+    if (function->name != NULL) writeString(out, function->name);
+
+    writeU32(out, (uint32_t)chunk->count());
+    out.insert(out.end(), chunk->code(), chunk->code() + chunk->count());
+
+    writeU32(out, (uint32_t)chunk->lineCount());
+    for (int i = 0; i < chunk->lineCount(); i++)
+    {
+        writeU32(out, (uint32_t)chunk->lineStarts()[i].offset);
+        writeU32(out, (uint32_t)chunk->lineStarts()[i].line);
+    }
+
+    const ValueArray& constants = chunk->constants();
+    writeU32(out, (uint32_t)constants.count());
+    for (int i = 0; i < constants.count(); i++)
+    {
+        Value constant = constants.elems()[i];
+        if (IS_NUMBER(constant))
+        {
+            double number = AS_NUMBER(constant);
+            uint64_t bits;
+            memcpy(&bits, &number, sizeof(double));
+            writeU8(out, CONSTANT_NUMBER);
+            writeU64(out, bits);
+        }
+        else if (IS_STRING(constant))
+        {
+            writeU8(out, CONSTANT_STRING);
+            writeString(out, AS_STRING(constant));
+        }
+        else
+        {
+            writeU8(out, CONSTANT_FUNCTION);
+            writeFunction(out, AS_FUNCTION(constant));
+        }
+    }
+}
+
+bool writeBytecode(const char* path, ObjFunction* function,
+                   uint64_t sourceHash)
+{
+    std::vector<uint8_t> out;
+    for (int i = 0; i < 4; i++) writeU8(out, BYTECODE_MAGIC[i]);
+    writeU32(out, BYTECODE_VERSION);
+    writeU32(out, opcodeCount);
+    writeU64(out, sourceHash);
+
+    ValueArray* globals = vm.globalNames();
+    writeU32(out, (uint32_t)globals->count());
+    for (int i = 0; i < globals->count(); i++)
+        writeString(out, AS_STRING(globals->elems()[i]));
+
+    writeFunction(out, function);
+
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) return false;
+
+    bool written = fwrite(out.data(), 1, out.size(), file) == out.size();
+    return fclose(file) == 0 && written;
+}
+
+/* reading */
+
+// Cursor over the mapped file. Every read is bounds-checked; once one fails
+// the reader stays failed and returns zeroes.
+struct Reader
+{
+    const uint8_t* pos;
+    const uint8_t* end;
+    bool failed;
+    uint32_t globalCount; // Slots the code may refer to.
+};
+
+static const uint8_t* readBytes(Reader* reader, size_t count)
+{
+    if (reader->failed || (size_t)(reader->end - reader->pos) < count)
+    {
+        reader->failed = true;
+        return NULL;
+    }
+
+    const uint8_t* bytes = reader->pos;
+    reader->pos += count;
+    return bytes;
+}
+
+static uint8_t readU8(Reader* reader)
+{
+    const uint8_t* bytes = readBytes(reader, 1);
+    return bytes == NULL ? 0 : bytes[0];
+}
+
+static uint32_t readU32(Reader* reader)
+{
+    const uint8_t* bytes = readBytes(reader, 4);
+    if (bytes == NULL) return 0;
+
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++) value |= (uint32_t)bytes[i] << (8 * i);
+    return value;
+}
+
+static uint64_t readU64(Reader* reader)
+{
+    const uint8_t* bytes = readBytes(reader, 8);
+    if (bytes == NULL) return 0;
+
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) value |= (uint64_t)bytes[i] << (8 * i);
+    return value;
+}
+
+static ObjString* readString(Reader* reader)
+{
+    uint32_t length = readU32(reader);
+    const uint8_t* chars = readBytes(reader, length);
+    if (chars == NULL) return NULL;
+
+    return copyString((const char*)chars, (int)length);
+}
+
+static bool isConstant(Chunk* chunk, uint32_t index, bool (*isType)(Value))
+{
+    return index < (uint32_t)chunk->constants().count() &&
+           (isType == NULL || isType(chunk->constants().elems()[index]));
+}
+
+static bool isString(Value value) { return IS_STRING(value); }
+static bool isFunction(Value value) { return IS_FUNCTION(value); }
+static bool isNumber(Value value) { return IS_NUMBER(value); }
+
+// Returns the size of the instruction at offset, or 0 if it isn't a known
+// opcode or doesn't fit in the chunk.
+static int decodeInstruction(Chunk* chunk, int offset)
+{
+    const uint8_t* code = chunk->code();
+    int count = chunk->count();
+    uint8_t instruction = code[offset];
+    if (instruction >= opcodeCount) return 0;
+
+    // instructionSize() looks at the function of OP_CLOSURE.
+    bool isLong = instruction == OP_CLOSURE_LONG;
+    if (instruction == OP_CLOSURE || isLong)
+    {
+        if (offset + (isLong ? 4 : 2) > count) return 0;
+        uint32_t index =
+          isLong ? chunk->readLong(offset + 1) : code[offset + 1];
+        if (!isConstant(chunk, index, isFunction)) return 0;
+    }
+    int size = chunk->instructionSize(offset);
+    return offset + size <= count ? size : 0;
+}
+
+// The inline cache index of the instruction at offset, which ends the
+// property and invoke instructions, or -1 if it has none.
+static int cacheOperand(Chunk* chunk, int offset, int size)
+{
+    switch (chunk->code()[offset])
+    {
+        case OP_GET_PROPERTY:
+        case OP_GET_PROPERTY_LONG:
+        case OP_SET_PROPERTY:
+        case OP_SET_PROPERTY_LONG:
+        case OP_INVOKE:
+        case OP_INVOKE_LONG:
+        case OP_SUPER_INVOKE:
+        case OP_SUPER_INVOKE_LONG: return chunk->readShort(offset + size - 2);
+        default: return -1;
+    }
+}
+
+// Checks the operands of the instruction at offset, which
+// decodeInstruction() has accepted, reached with height values on the stack
+// of the frame, slot 0 included. Stores the height after it in *next and
+// where it can jump to in *target, or -1 if nowhere. Returns false if the
+// instruction isn't valid.
+static bool verifyInstruction(ObjFunction* function, uint32_t globalCount,
+                              int offset, int height, int* next, int* target)
+{
+    Chunk* chunk = &function->chunk;
+    const uint8_t* code = chunk->code();
+    uint8_t instruction = code[offset];
+    switch (instruction)
+    {
+        case OP_CONSTANT:
+            if (!isConstant(chunk, code[offset + 1], NULL)) return false;
+            break;
+        case OP_CONSTANT_LONG:
+            if (!isConstant(chunk, chunk->readLong(offset + 1), NULL))
+                return false;
+            break;
+
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+            if (chunk->readShort(offset + 1) >= globalCount) return false;
+            break;
+
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+            if (code[offset + 1] >= height) return false;
+            break;
+        case OP_GET_LOCAL_LONG:
+        case OP_SET_LOCAL_LONG:
+            if (chunk->readShort(offset + 1) >= height) return false;
+            break;
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+            if (code[offset + 1] >= function->upvalueCount) return false;
+            break;
+        case OP_GET_UPVALUE_LONG:
+        case OP_SET_UPVALUE_LONG:
+            if (chunk->readShort(offset + 1) >= function->upvalueCount)
+                return false;
+            break;
+
+        case OP_CLOSURE:
+        case OP_CLOSURE_LONG:
+        {
+            // The captured locals may include the slot the closure is pushed
+            // to, for a local function that refers to itself.
+            bool isLong = instruction == OP_CLOSURE_LONG;
+            int end = offset + chunk->instructionSize(offset);
+            int position = offset + (isLong ? 4 : 2);
+            while (position < end)
+            {
+                uint8_t isLocal = code[position++];
+                int index = isLong ? chunk->readShort(position)
+                                   : code[position];
+                position += isLong ? 2 : 1;
+                if (isLocal > 1) return false;
+                if (isLocal ? index > height
+                            : index >= function->upvalueCount)
+                    return false;
+            }
+            break;
+        }
+
+        case OP_CLASS:
+        case OP_CLASS_LONG:
+        case OP_METHOD:
+        case OP_METHOD_LONG:
+        case OP_GET_SUPER:
+        case OP_GET_SUPER_LONG:
+        case OP_GET_PROPERTY:
+        case OP_GET_PROPERTY_LONG:
+        case OP_SET_PROPERTY:
+        case OP_SET_PROPERTY_LONG:
+        case OP_INVOKE:
+        case OP_INVOKE_LONG:
+        case OP_SUPER_INVOKE:
+        case OP_SUPER_INVOKE_LONG:
+        {
+            // A name constant, then for the property and invoke
+            // instructions an argument count (invoke only) and the inline
+            // cache index, which verifyCode() checks.
+            bool isWide =
+              instruction == OP_CLASS_LONG || instruction == OP_METHOD_LONG ||
+              instruction == OP_GET_SUPER_LONG ||
+              instruction == OP_GET_PROPERTY_LONG ||
+              instruction == OP_SET_PROPERTY_LONG ||
+              instruction == OP_INVOKE_LONG ||
+              instruction == OP_SUPER_INVOKE_LONG;
+            uint32_t name =
+              isWide ? chunk->readLong(offset + 1) : code[offset + 1];
+            if (!isConstant(chunk, name, isString)) return false;
+            break;
+        }
+
+        case OP_ADD_LOCALS:
+        case OP_SUBTRACT_LOCALS:
+        case OP_MULTIPLY_LOCALS:
+        case OP_DIVIDE_LOCALS:
+            if (code[offset + 1] >= height || code[offset + 2] >= height)
+                return false;
+            break;
+        case OP_JUMP_IF_LESS:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_GREATER:
+        case OP_JUMP_IF_NOT_GREATER:
+            if (!isConstant(chunk, code[offset + 1], isNumber)) return false;
+            break;
+        case OP_INCREMENT_LOCAL:
+            if (code[offset + 1] >= height ||
+                !isConstant(chunk, code[offset + 2], isNumber))
+                return false;
+            break;
+
+        default: break;
+    }
+
+    // Slot 0 belongs to the frame's callee and is never popped by its code.
+    int pops;
+    int pushes;
+    chunk->stackEffect(offset, &pops, &pushes);
+    if (pops >= height) return false;
+    *next = height - pops + pushes;
+    *target = chunk->jumpTarget(offset);
+    return *target == -1 || (*target >= 0 && *target < chunk->count());
+}
+
+// Decodes the code of function from start to end, then walks it from its
+// start, checking each instruction it can reach. Calls check slotCount
+// against the stack left, so it is raised to the height the code reaches,
+// temporaries included.
+static bool verifyCode(ObjFunction* function, uint32_t globalCount)
+{
+    Chunk* chunk = &function->chunk;
+    int count = chunk->count();
+    if (count == 0) return false;
+
+    // The compiler gives each property and invoke instruction a cache of its
+    // own, unreachable ones included. Two sharing one would hit on each
+    // other's entries, and a get could read a field at the slot a set's
+    // transition added.
+    std::vector<bool> starts(count, false);
+    std::vector<int> cacheOwners(chunk->cacheCount(), -1);
+    int sites = 0;
+    for (int offset = 0, size; offset < count; offset += size)
+    {
+        starts[offset] = true;
+        size = decodeInstruction(chunk, offset);
+        if (size == 0) return false;
+
+        int cache = cacheOperand(chunk, offset, size);
+        if (cache == -1) continue;
+        if (cache >= chunk->cacheCount() || cacheOwners[cache] != -1)
+            return false;
+        cacheOwners[cache] = offset;
+        sites++;
+    }
+    if (sites != chunk->cacheCount()) return false;
+
+    // The stack height each reached instruction starts with, -1 where none
+    // has been reached.
+    std::vector<int> heights(count, -1);
+    std::vector<int> pending;
+    heights[0] = function->arity + 1;
+    pending.push_back(0);
+    int maxHeight = heights[0];
+
+    while (!pending.empty())
+    {
+        int offset = pending.back();
+        pending.pop_back();
+
+        int next;
+        int target;
+        if (!verifyInstruction(function, globalCount, offset, heights[offset],
+                               &next, &target))
+            return false;
+        // OP_ADD_LOCALS pushes both operands before taking the slow path.
+        maxHeight = std::max(maxHeight, next + 1);
+        if (maxHeight > STACK_MAX) return false;
+
+        uint8_t instruction = function->chunk.code()[offset];
+        bool fallsThrough = instruction != OP_RETURN &&
+                            instruction != OP_JUMP &&
+                            instruction != OP_JUMP_LONG &&
+                            instruction != OP_LOOP &&
+                            instruction != OP_LOOP_LONG;
+        int successors[2] = {
+          fallsThrough ? offset + function->chunk.instructionSize(offset) : -1,
+          target};
+        for (int successor : successors)
+        {
+            if (successor == -1) continue;
+            if (successor >= count) return false; // Runs off the end.
+            if (!starts[successor]) return false; // Inside an instruction.
+            if (heights[successor] == -1)
+            {
+                heights[successor] = next;
+                pending.push_back(successor);
+            }
+            else if (heights[successor] != next)
+                return false;
+        }
+    }
+
+    function->slotCount = std::max(function->slotCount, maxHeight);
+    return true;
+}
+
+// Reads a function record. The function stays on the VM stack while its
+// constants are allocated so a collection can't free it half-built.
+static ObjFunction* readFunction(Reader* reader, int depth)
+{
+    if (depth > FUNCTION_DEPTH_MAX)
+    {
+        reader->failed = true;
+        return NULL;
+    }
+
+    ObjFunction* function = newFunction();
+    vm.push(OBJ_VAL(function));
+
+    uint32_t arity = readU32(reader);
+    uint32_t upvalueCount = readU32(reader);
+    uint32_t slotCount = readU32(reader);
+    uint32_t cacheCount = readU32(reader);
+    if (arity > UINT8_MAX || upvalueCount > UINT16_MAX ||
+        slotCount > STACK_MAX)
+        reader->failed = true;
+    function->arity = (int)arity;
+    function->upvalueCount = (int)upvalueCount;
+    function->slotCount = (int)slotCount;
+    if (readU8(reader))
+    {
+        storeShared(&function->name, readString(reader));
+        writeBarrier((Obj*)function, (Obj*)function->name);
+    }
+
+    Chunk* chunk = &function->chunk;
+    uint32_t codeLength = readU32(reader);
+    const uint8_t* code = readBytes(reader, codeLength);
+    if (code != NULL) chunk->borrowCode(code, (int)codeLength);
+
+    // getLine() needs a run, and every inline cache is used by a 16-bit
+    // operand of some instruction.
+    uint32_t lineCount = readU32(reader);
+    if (lineCount == 0 || cacheCount > UINT16_COUNT ||
+        cacheCount > codeLength)
+        reader->failed = true;
+
+    std::vector<LineStart> lines;
+    for (uint32_t i = 0; i < lineCount && !reader->failed; i++)
+    {
+        int offset = (int)readU32(reader);
+        int line = (int)readU32(reader);
+        lines.push_back({offset, line});
+    }
+    if (!reader->failed) chunk->setLines(lines.data(), (int)lines.size());
+
+    for (uint32_t i = 0; i < cacheCount && !reader->failed; i++)
+        chunk->addInlineCache();
+
+    uint32_t constantCount = readU32(reader);
+    for (uint32_t i = 0; i < constantCount && !reader->failed; i++)
+    {
+        Value constant = NIL_VAL;
+        switch (readU8(reader))
+        {
+            case CONSTANT_NUMBER:
+            {
+                uint64_t bits = readU64(reader);
+                double number;
+                memcpy(&number, &bits, sizeof(double));
+                constant = NUMBER_VAL(number);
+                break;
+            }
+            case CONSTANT_STRING:
+            {
+                ObjString* string = readString(reader);
+                if (string != NULL) constant = OBJ_VAL(string);
+                break;
+            }
+            case CONSTANT_FUNCTION:
+            {
+                ObjFunction* nested = readFunction(reader, depth + 1);
+                if (nested != NULL) constant = OBJ_VAL(nested);
+                break;
+            }
+            default: reader->failed = true; break;
+        }
+        if (reader->failed) break;
+        chunk->addConstant(constant);
+        writeBarrier((Obj*)function, constant);
+    }
+
+    if (!reader->failed && !verifyCode(function, reader->globalCount))
+        reader->failed = true;
+
+    vm.pop();
+    return reader->failed ? NULL : function;
+}
+
+static bool readHeader(Reader* reader, uint64_t* sourceHash)
+{
+    const uint8_t* magic = readBytes(reader, 4);
+    if (magic == NULL || memcmp(magic, BYTECODE_MAGIC, 4) != 0) return false;
+    if (readU32(reader) != BYTECODE_VERSION) return false;
+    if (readU32(reader) != opcodeCount) return false;
+
+    uint64_t hash = readU64(reader);
+    if (sourceHash != NULL) *sourceHash = hash;
+    return !reader->failed;
+}
+
+bool isBytecodeFile(const char* path, uint64_t* sourceHash)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return false;
+
+    uint8_t header[HEADER_SIZE];
+    size_t bytesRead = fread(header, 1, HEADER_SIZE, file);
+    fclose(file);
+
+    Reader reader = {header, header + bytesRead, false, 0};
+    return readHeader(&reader, sourceHash);
+}
+
+ObjFunction* loadBytecode(const char* path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        return NULL;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < HEADER_SIZE)
+    {
+        close(fd);
+        fprintf(stderr, "\"%s\" is not a bytecode file.\n", path);
+        return NULL;
+    }
+
+    size_t size = (size_t)info.st_size;
+    void* address = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (address == MAP_FAILED)
+    {
+        fprintf(stderr, "Could not map file \"%s\".\n", path);
+        return NULL;
+    }
+
+    const uint8_t* bytes = (const uint8_t*)address;
+    Reader reader = {bytes, bytes + size, false, 0};
+    if (!readHeader(&reader, NULL))
+    {
+        munmap(address, size);
+        fprintf(stderr, "\"%s\" is not bytecode for this version of lox.\n",
+                path);
+        return NULL;
+    }
+
+    uint32_t globalCount = readU32(&reader);
+    reader.globalCount = globalCount;
+    for (uint32_t i = 0; i < globalCount && !reader.failed; i++)
+    {
+        ObjString* name = readString(&reader);
+        if (name != NULL && vm.globalSlot(name) != (int)i)
+        {
+            munmap(address, size);
+            fprintf(stderr, "\"%s\" was compiled against different globals.\n",
+                    path);
+            return NULL;
+        }
+    }
+
+    // The script is called with no arguments and has nothing to close over.
+    ObjFunction* function = readFunction(&reader, 0);
+    if (function != NULL &&
+        (function->arity != 0 || function->upvalueCount != 0))
+        function = NULL;
+    if (function == NULL)
+    {
+        // Nothing ran yet, so the half-built functions are unreachable and
+        // never touch their code again.
+        munmap(address, size);
+        fprintf(stderr, "\"%s\" is truncated or corrupt.\n", path);
+        return NULL;
+    }
+
+    mappings.push_back({address, size});
+    return function;
+}
+
+void unmapBytecode()
+{
+    for (const Mapping& mapping : mappings)
+        munmap(mapping.address, mapping.size);
+    mappings.clear();
+}
+
+} // namespace lox
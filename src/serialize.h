@@ -0,0 +1,31 @@
+#pragma once
+
+#include "common.h"
+#include "object.h"
+
+namespace lox
+{
+
+// Compiled scripts can be saved as .loxc files and run later without going
+// through the compiler. The file holds the whole ObjFunction tree, and the
+// loader maps it into memory and runs the code bytes in place.
+
+uint64_t hashSource(const char* source);
+
+bool writeBytecode(const char* path, ObjFunction* function,
+                   uint64_t sourceHash);
+
+// Whether path starts with a bytecode header this build understands. When it
+// does and sourceHash isn't NULL, stores the hash of the source it was
+// compiled from.
+bool isBytecodeFile(const char* path, uint64_t* sourceHash);
+
+// Maps path and rebuilds its function tree in the VM. Returns NULL, after
+// reporting why, if the file is not valid bytecode for this build.
+ObjFunction* loadBytecode(const char* path);
+
+// Releases the mappings made by loadBytecode(). Only call once the VM has
+// freed every function that may point into them.
+void unmapBytecode();
+
+} // namespace lox
@@ -0,0 +1,107 @@
+#include "shape.h"
+
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+// Shapes with at most this many fields are searched by walking the parent
+// chain. Wider ones get a name -> slot table built on first lookup.
+#define SHAPE_MAX_LINEAR_LOOKUP 8
+
+namespace lox
+{
+
+static Shape* newShape(Shape* parent, ObjString* name)
+{
+    Shape* shape = ALLOCATE(Shape, 1);
+    shape->parent = parent;
+    shape->name = name;
+    shape->slot = parent == NULL ? -1 : parent->fieldCount;
+    shape->fieldCount = parent == NULL ? 0 : parent->fieldCount + 1;
+    initTable(&shape->transitions);
+    initTable(&shape->slots);
+
+    if (vm.shapeCapacity_ < vm.shapeCount_ + 1)
+    {
+        int oldCapacity = vm.shapeCapacity_;
+        vm.shapeCapacity_ = GROW_CAPACITY(oldCapacity);
+        vm.shapes_ =
+          GROW_ARRAY(Shape*, vm.shapes_, oldCapacity, vm.shapeCapacity_);
+    }
+    vm.shapes_[vm.shapeCount_++] = shape;
+    return shape;
+}
+
+Shape* newRootShape()
+{
+    return newShape(NULL, NULL);
+}
+
+Shape* shapeAddField(Shape* shape, ObjString* name)
+{
+    Value index;
+    if (tableGet(&shape->transitions, name, &index))
+        return vm.shapes_[(int)AS_NUMBER(index)];
+
+    Shape* child = newShape(shape, name);
+    tableSet(&shape->transitions, name,
+             NUMBER_VAL((double)(vm.shapeCount_ - 1)));
+    return child;
+}
+
+int shapeFindSlot(Shape* shape, ObjString* name)
+{
+    if (shape->fieldCount <= SHAPE_MAX_LINEAR_LOOKUP)
+    {
+        for (Shape* s = shape; s->name != NULL; s = s->parent)
+            if (s->name == name) return s->slot;
+        return -1;
+    }
+
+    if (shape->slots.count == 0)
+    {
+        for (Shape* s = shape; s->name != NULL; s = s->parent)
+            tableSet(&shape->slots, s->name, NUMBER_VAL((double)s->slot));
+    }
+
+    Value slot;
+    if (!tableGet(&shape->slots, name, &slot)) return -1;
+    return (int)AS_NUMBER(slot);
+}
+
+// Transition and slot tables are keyed by names of shapes in the tree, so
+// marking every shape's own name keeps all of them alive.
+void markShapes()
+{
+    for (int i = 0; i < vm.shapeCount_; i++)
+        markObject((Obj*)vm.shapes_[i]->name);
+}
+
+void forwardShapes()
+{
+    for (int i = 0; i < vm.shapeCount_; i++)
+    {
+        Shape* shape = vm.shapes_[i];
+        shape->name = (ObjString*)forwardObject((Obj*)shape->name);
+        forwardTable(&shape->transitions);
+        forwardTable(&shape->slots);
+    }
+}
+
+void freeShapes()
+{
+    for (int i = 0; i < vm.shapeCount_; i++)
+    {
+        Shape* shape = vm.shapes_[i];
+        freeTable(&shape->transitions);
+        freeTable(&shape->slots);
+        FREE(Shape, shape);
+    }
+    FREE_ARRAY(Shape*, vm.shapes_, vm.shapeCapacity_);
+    vm.shapes_ = NULL;
+    vm.shapeCount_ = 0;
+    vm.shapeCapacity_ = 0;
+    vm.rootShape_ = NULL;
+}
+
+} // namespace lox
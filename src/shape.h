@@ -0,0 +1,38 @@
+#pragma once
+
+#include "common.h"
+#include "table.h"
+#include "value.h"
+
+namespace lox
+{
+
+// A hidden class describing the field layout of an ObjInstance. Shapes form
+// a transition tree rooted at VM::rootShape_: storing a new field "x" into an
+// instance of shape S moves the instance to S's child for "x". Instances that
+// get the same fields in the same order therefore share one Shape and keep
+// their values in a flat array indexed by slot.
+//
+// Shapes are not GC objects. The VM owns every shape it ever created until it
+// is freed, so inline caches can key on shape pointers without a dead shape's
+// address ever being reused for a different layout.
+struct Shape
+{
+    Shape* parent;
+    ObjString* name; // Field added by the transition from parent.
+    int slot;        // Slot of that field.
+    int fieldCount;
+
+    Table transitions; // Field name -> index of the child in VM::shapes_.
+    Table slots;       // Field name -> slot. Only built for wide shapes.
+};
+
+Shape* newRootShape();
+Shape* shapeAddField(Shape* shape, ObjString* name);
+int shapeFindSlot(Shape* shape, ObjString* name);
+
+void markShapes();
+void forwardShapes();
+void freeShapes();
+
+} // namespace lox
@@ -0,0 +1,612 @@
+#include "snapshot.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "allocator.h"
+#include "compiler.h"
+#include "object.h"
+#include "vm.h"
+
+#define SNAPSHOT_HEADER "lox heap snapshot 1"
+
+namespace lox
+{
+
+// Writing. Objects get their ids in the order the walk finds them, which
+// is breadth first from the roots.
+
+struct SnapshotWriter
+{
+    FILE* file;
+    std::unordered_map<Obj*, int> ids;
+    std::vector<Obj*> objects; // By id.
+    std::vector<int> edges;    // Of the object being written.
+};
+
+static int objectId(SnapshotWriter* writer, Obj* object)
+{
+    auto found = writer->ids.find(object);
+    if (found != writer->ids.end()) return found->second;
+
+    int id = (int)writer->objects.size();
+    writer->ids[object] = id;
+    writer->objects.push_back(object);
+    return id;
+}
+
+static void writeRoot(SnapshotWriter* writer, const char* kind,
+                      const char* name, Obj* object)
+{
+    if (object == NULL) return;
+    fprintf(writer->file, "root %s %s %d\n", kind, name,
+            objectId(writer, object));
+}
+
+static void writeRootValue(SnapshotWriter* writer, const char* kind,
+                           const char* name, Value value)
+{
+    if (IS_OBJ(value)) writeRoot(writer, kind, name, AS_OBJ(value));
+}
+
+static const char* functionName(ObjFunction* function)
+{
+    return function->name == NULL ? "script" : function->name->chars;
+}
+
+// Follows markRoots().
+static void writeRoots(SnapshotWriter* writer)
+{
+    for (Value* slot = vm.stack(); slot < vm.stackTop(); slot++)
+        writeRootValue(writer, "stack", "-", *slot);
+
+    for (int i = 0; i < vm.frameCount(); i++)
+    {
+        ObjClosure* closure = vm.frames()[i].closure;
+        writeRoot(writer, "frame", functionName(closure->function),
+                  (Obj*)closure);
+    }
+
+    for (ObjUpvalue* upvalue = vm.openUpvalues(); upvalue != NULL;
+         upvalue = upvalue->next)
+        writeRoot(writer, "upvalue", "-", (Obj*)upvalue);
+
+    for (int i = 0; i < vm.globalNames()->count(); i++)
+    {
+        Value name = vm.globalNames()->elems()[i];
+        writeRootValue(writer, "globalName", "-", name);
+        writeRootValue(writer, "global", AS_CSTRING(name),
+                       vm.globalValues()[i]);
+    }
+
+    std::vector<ObjFunction*> functions;
+    listCompilerRoots(&functions);
+    for (ObjFunction* function : functions)
+        writeRoot(writer, "compiler", functionName(function), (Obj*)function);
+
+    for (int i = 0; i < vm.shapeCount_; i++)
+        writeRoot(writer, "shape", "-", (Obj*)vm.shapes_[i]->name);
+    writeRoot(writer, "init", "-", (Obj*)vm.initString_);
+}
+
+static void addEdge(SnapshotWriter* writer, Obj* object)
+{
+    if (object != NULL) writer->edges.push_back(objectId(writer, object));
+}
+
+static void addEdge(SnapshotWriter* writer, Value value)
+{
+    if (IS_OBJ(value)) addEdge(writer, AS_OBJ(value));
+}
+
+// Follows blackenObject().
+static void findEdges(SnapshotWriter* writer, Obj* object)
+{
+    switch (object->type)
+    {
+        case OBJ_UPVALUE:
+            addEdge(writer, ((ObjUpvalue*)object)->closed);
+            break;
+        case OBJ_FUNCTION:
+        {
+            ObjFunction* function = (ObjFunction*)object;
+            addEdge(writer, (Obj*)function->name);
+            const ValueArray& constants = function->chunk.constants();
+            for (int i = 0; i < constants.count(); i++)
+                addEdge(writer, constants.elems()[i]);
+            break;
+        }
+        case OBJ_CLOSURE:
+        {
+            ObjClosure* closure = (ObjClosure*)object;
+            addEdge(writer, (Obj*)closure->function);
+            for (int i = 0; i < closure->upvalueCount; i++)
+                addEdge(writer, (Obj*)closure->upvalues[i]);
+            break;
+        }
+        case OBJ_NATIVE:
+        case OBJ_STRING: break;
+        case OBJ_CLASS:
+        {
+            ObjClass* klass = (ObjClass*)object;
+            addEdge(writer, (Obj*)klass->name);
+            for (int i = 0; i <= klass->methods.capacity; i++)
+            {
+                Entry* entry = &klass->methods.entries[i];
+                addEdge(writer, (Obj*)entry->key);
+                addEdge(writer, entry->value);
+            }
+            break;
+        }
+        case OBJ_INSTANCE:
+        {
+            ObjInstance* instance = (ObjInstance*)object;
+            addEdge(writer, (Obj*)instance->klass);
+            for (int i = 0; i < instance->shape->fieldCount; i++)
+                addEdge(writer, instance->fields[i]);
+            break;
+        }
+        case OBJ_BOUND_METHOD:
+        {
+            ObjBoundMethod* bound = (ObjBoundMethod*)object;
+            addEdge(writer, bound->receiver);
+            addEdge(writer, (Obj*)bound->method);
+            break;
+        }
+    }
+}
+
+// The object's block and the arrays it owns, see freeObject().
+static size_t objectBytes(Obj* object)
+{
+    size_t size = objectBlockSize(object);
+    switch (object->type)
+    {
+        case OBJ_FUNCTION:
+        {
+            const Chunk& chunk = ((ObjFunction*)object)->chunk;
+            return size + blockSize(chunk.capacity()) +
+                   blockSize(sizeof(LineStart) * chunk.lineCount()) +
+                   blockSize(sizeof(Value) * chunk.constants().capacity()) +
+                   blockSize(sizeof(InlineCache) * chunk.cacheCount());
+        }
+        case OBJ_CLOSURE:
+        {
+            int count = ((ObjClosure*)object)->upvalueCount;
+            return size + blockSize(sizeof(ObjUpvalue*) * count);
+        }
+        case OBJ_CLASS:
+        {
+            int capacity = ((ObjClass*)object)->methods.capacity;
+            return size + blockSize(sizeof(Entry) * (capacity + 1));
+        }
+        case OBJ_INSTANCE:
+        {
+            int count = ((ObjInstance*)object)->shape->fieldCount;
+            return size + blockSize(sizeof(Value) * fieldCapacity(count));
+        }
+        default: return size;
+    }
+}
+
+static const char* objectName(Obj* object)
+{
+    switch (object->type)
+    {
+        case OBJ_FUNCTION: return functionName((ObjFunction*)object);
+        case OBJ_CLOSURE:
+            return functionName(((ObjClosure*)object)->function);
+        case OBJ_CLASS: return ((ObjClass*)object)->name->chars;
+        case OBJ_INSTANCE:
+            return ((ObjInstance*)object)->klass->name->chars;
+        case OBJ_BOUND_METHOD:
+            return functionName(((ObjBoundMethod*)object)->method->function);
+        default: return "-";
+    }
+}
+
+// Nothing the walk does allocates from the VM's heap, so no collection can
+// run in the middle of it.
+bool writeHeapSnapshot(const char* path)
+{
+    SnapshotWriter writer;
+    writer.file = fopen(path, "w");
+    if (writer.file == NULL) return false;
+
+    fprintf(writer.file, "%s\n", SNAPSHOT_HEADER);
+    writeRoots(&writer);
+
+    for (size_t id = 0; id < writer.objects.size(); id++)
+    {
+        Obj* object = writer.objects[id];
+        writer.edges.clear();
+        findEdges(&writer, object);
+
+        fprintf(writer.file, "object %zu %s %zu %s", id,
+                objTypeName(object->type), objectBytes(object),
+                objectName(object));
+        for (int edge : writer.edges) fprintf(writer.file, " %d", edge);
+        fputc('\n', writer.file);
+    }
+
+    bool written = !ferror(writer.file);
+    return fclose(writer.file) == 0 && written;
+}
+
+// Reporting. The snapshot becomes a graph with a node for each object and
+// each root, grouped by kind except for globals, which get a node each. A
+// node of its own above those is the single root the dominator tree needs.
+// Node A dominates node B if every path from the top to B goes through A,
+// so B would be garbage without A. What a node retains is the total size of
+// the nodes it dominates, itself included.
+
+struct HeapGraph
+{
+    std::vector<size_t> sizes;
+    std::vector<int> labels; // Index in labelNames.
+    std::vector<std::string> labelNames;
+    std::vector<int> edgeStarts; // Edges of node i are from edgeStarts[i]
+    std::vector<int> edges;      // to edgeStarts[i + 1].
+    int rootCount;               // Nodes 1 to rootCount are roots.
+};
+
+static int labelIndex(HeapGraph* graph,
+                      std::unordered_map<std::string, int>* indices,
+                      const std::string& label)
+{
+    auto found = indices->find(label);
+    if (found != indices->end()) return found->second;
+
+    int index = (int)graph->labelNames.size();
+    (*indices)[label] = index;
+    graph->labelNames.push_back(label);
+    return index;
+}
+
+static bool readGraph(FILE* file, HeapGraph* graph)
+{
+    char* line = NULL;
+    size_t capacity = 0;
+    if (getline(&line, &capacity, file) <= 0 ||
+        strncmp(line, SNAPSHOT_HEADER "\n", strlen(SNAPSHOT_HEADER) + 1) != 0)
+    {
+        ::free(line);
+        return false;
+    }
+
+    std::unordered_map<std::string, int> labels;
+    std::unordered_map<std::string, int> rootNodes;
+    std::vector<std::vector<int>> rootEdges;
+    std::vector<int> rootLabels;
+    std::vector<size_t> objectSizes;
+    std::vector<int> objectLabels;
+    std::vector<int> objectEdgeStarts;
+    std::vector<int> objectEdges;
+
+    bool valid = true;
+    while (valid && getline(&line, &capacity, file) > 0)
+    {
+        char* save;
+        char* word = strtok_r(line, " \n", &save);
+        if (word != NULL && strcmp(word, "root") == 0)
+        {
+            char* kind = strtok_r(NULL, " \n", &save);
+            char* name = strtok_r(NULL, " \n", &save);
+            char* id = strtok_r(NULL, " \n", &save);
+            if (id == NULL || !objectSizes.empty())
+            {
+                valid = false;
+                break;
+            }
+
+            std::string label = kind;
+            if (strcmp(kind, "global") == 0) label += std::string(" ") + name;
+            auto found = rootNodes.find(label);
+            int root = found == rootNodes.end() ? -1 : found->second;
+            if (root == -1)
+            {
+                root = (int)rootEdges.size();
+                rootNodes[label] = root;
+                rootEdges.emplace_back();
+                rootLabels.push_back(labelIndex(graph, &labels, label));
+            }
+            rootEdges[root].push_back(atoi(id));
+        }
+        else if (word != NULL && strcmp(word, "object") == 0)
+        {
+            char* id = strtok_r(NULL, " \n", &save);
+            char* type = strtok_r(NULL, " \n", &save);
+            char* bytes = strtok_r(NULL, " \n", &save);
+            char* name = strtok_r(NULL, " \n", &save);
+            if (name == NULL || atoi(id) != (int)objectSizes.size())
+            {
+                valid = false;
+                break;
+            }
+
+            // Instances are told apart by class, other objects by type.
+            std::string label;
+            if (strcmp(type, "instance") == 0)
+                label = name;
+            else
+            {
+                label = "(";
+                label += type;
+                label += ')';
+            }
+            objectSizes.push_back(strtoull(bytes, NULL, 10));
+            objectLabels.push_back(labelIndex(graph, &labels, label));
+            objectEdgeStarts.push_back((int)objectEdges.size());
+            while ((word = strtok_r(NULL, " \n", &save)) != NULL)
+                objectEdges.push_back(atoi(word));
+        }
+        else
+            valid = false;
+    }
+    ::free(line);
+
+    int objectCount = (int)objectSizes.size();
+    graph->rootCount = (int)rootEdges.size();
+    int firstObject = 1 + graph->rootCount;
+
+    // The top node, then the roots, then the objects.
+    graph->sizes.assign(firstObject, 0);
+    graph->labels.assign(1, -1);
+    graph->labels.insert(graph->labels.end(), rootLabels.begin(),
+                         rootLabels.end());
+    graph->edgeStarts.push_back(0);
+    for (int i = 0; i < graph->rootCount; i++)
+    {
+        graph->edges.push_back(1 + i);
+    }
+    for (std::vector<int>& targets : rootEdges)
+    {
+        graph->edgeStarts.push_back((int)graph->edges.size());
+        for (int target : targets) graph->edges.push_back(firstObject + target);
+    }
+
+    graph->sizes.insert(graph->sizes.end(), objectSizes.begin(),
+                        objectSizes.end());
+    graph->labels.insert(graph->labels.end(), objectLabels.begin(),
+                         objectLabels.end());
+    for (int i = 0; i < objectCount; i++)
+    {
+        graph->edgeStarts.push_back((int)graph->edges.size());
+        int end = i + 1 < objectCount ? objectEdgeStarts[i + 1]
+                                      : (int)objectEdges.size();
+        for (int j = objectEdgeStarts[i]; j < end; j++)
+            graph->edges.push_back(firstObject + objectEdges[j]);
+    }
+    graph->edgeStarts.push_back((int)graph->edges.size());
+
+    for (int target : graph->edges)
+    {
+        if (target < 0 || target >= (int)graph->sizes.size()) valid = false;
+    }
+    return valid;
+}
+
+// Numbers the nodes reachable from the top in depth-first postorder, and
+// returns them in that order.
+static std::vector<int> postorder(const HeapGraph& graph,
+                                  std::vector<int>* numbers)
+{
+    int nodeCount = (int)graph.sizes.size();
+    std::vector<int> order;
+    std::vector<int> next(nodeCount, -1); // Edge to follow, -1 if unvisited.
+    std::vector<int> stack = {0};
+    numbers->assign(nodeCount, -1);
+    next[0] = graph.edgeStarts[0];
+
+    while (!stack.empty())
+    {
+        int node = stack.back();
+        if (next[node] < graph.edgeStarts[node + 1])
+        {
+            int target = graph.edges[next[node]++];
+            if (next[target] == -1)
+            {
+                next[target] = graph.edgeStarts[target];
+                stack.push_back(target);
+            }
+            continue;
+        }
+
+        stack.pop_back();
+        (*numbers)[node] = (int)order.size();
+        order.push_back(node);
+    }
+    return order;
+}
+
+// The immediate dominator of each node, by the iterative algorithm of
+// Cooper, Harvey and Kennedy, or -1 for nodes the top doesn't reach.
+static std::vector<int> dominators(const HeapGraph& graph,
+                                   const std::vector<int>& order,
+                                   const std::vector<int>& numbers)
+{
+    int nodeCount = (int)graph.sizes.size();
+    std::vector<int> predecessorStarts(nodeCount + 1, 0);
+    for (int target : graph.edges) predecessorStarts[target + 1]++;
+    for (int i = 0; i < nodeCount; i++)
+        predecessorStarts[i + 1] += predecessorStarts[i];
+
+    std::vector<int> predecessors(graph.edges.size());
+    std::vector<int> filled(predecessorStarts.begin(),
+                            predecessorStarts.end() - 1);
+    for (int node = 0; node < nodeCount; node++)
+    {
+        for (int i = graph.edgeStarts[node]; i < graph.edgeStarts[node + 1];
+             i++)
+            predecessors[filled[graph.edges[i]]++] = node;
+    }
+
+    std::vector<int> idoms(nodeCount, -1);
+    idoms[0] = 0;
+    for (bool changed = true; changed;)
+    {
+        changed = false;
+        for (int i = (int)order.size() - 2; i >= 0; i--)
+        {
+            int node = order[i];
+            int idom = -1;
+            for (int j = predecessorStarts[node];
+                 j < predecessorStarts[node + 1]; j++)
+            {
+                int other = predecessors[j];
+                if (idoms[other] == -1) continue;
+                if (idom == -1)
+                {
+                    idom = other;
+                    continue;
+                }
+
+                while (idom != other)
+                {
+                    while (numbers[idom] < numbers[other]) idom = idoms[idom];
+                    while (numbers[other] < numbers[idom])
+                        other = idoms[other];
+                }
+            }
+
+            if (idom != idoms[node])
+            {
+                idoms[node] = idom;
+                changed = true;
+            }
+        }
+    }
+    return idoms;
+}
+
+struct LabelTotals
+{
+    int label;
+    size_t count;
+    size_t shallow;
+    size_t retained;
+};
+
+static bool byRetained(const LabelTotals& a, const LabelTotals& b)
+{
+    return a.retained > b.retained;
+}
+
+bool reportHeapSnapshot(const char* path, FILE* out)
+{
+    FILE* file = fopen(path, "r");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        return false;
+    }
+
+    HeapGraph graph;
+    bool valid = readGraph(file, &graph);
+    fclose(file);
+    if (!valid)
+    {
+        fprintf(stderr, "Invalid heap snapshot \"%s\".\n", path);
+        return false;
+    }
+
+    std::vector<int> numbers;
+    std::vector<int> order = postorder(graph, &numbers);
+    std::vector<int> idoms = dominators(graph, order, numbers);
+
+    // Postorder visits a node's dominator after the node itself.
+    int nodeCount = (int)graph.sizes.size();
+    std::vector<size_t> retained(graph.sizes);
+    for (int node : order)
+    {
+        if (node != 0) retained[idoms[node]] += retained[node];
+    }
+
+    // A class retains what its instances do, except for instances that
+    // another instance of the class dominates, which that one's share
+    // already includes. The dominator tree is walked depth first, keeping
+    // count of the instances of each class on the way down.
+    std::vector<int> childStarts(nodeCount + 1, 0);
+    for (int node : order)
+    {
+        if (node != 0) childStarts[idoms[node] + 1]++;
+    }
+    for (int i = 0; i < nodeCount; i++) childStarts[i + 1] += childStarts[i];
+    std::vector<int> children(order.size());
+    std::vector<int> filled(childStarts.begin(), childStarts.end() - 1);
+    for (int node : order)
+    {
+        if (node != 0) children[filled[idoms[node]]++] = node;
+    }
+
+    int firstObject = 1 + graph.rootCount;
+    std::vector<LabelTotals> totals(graph.labelNames.size());
+    for (size_t i = 0; i < totals.size(); i++) totals[i] = {(int)i, 0, 0, 0};
+    std::vector<int> onPath(graph.labelNames.size(), 0);
+    std::vector<int> next(nodeCount);
+    std::vector<int> stack = {0};
+    next[0] = childStarts[0];
+    while (!stack.empty())
+    {
+        int node = stack.back();
+        if (next[node] < childStarts[node + 1])
+        {
+            int child = children[next[node]++];
+            next[child] = childStarts[child];
+            stack.push_back(child);
+
+            if (child >= firstObject)
+            {
+                LabelTotals* label = &totals[graph.labels[child]];
+                label->count++;
+                label->shallow += graph.sizes[child];
+                if (onPath[label->label]++ == 0)
+                    label->retained += retained[child];
+            }
+            continue;
+        }
+
+        stack.pop_back();
+        if (node >= firstObject) onPath[graph.labels[node]]--;
+    }
+
+    std::vector<LabelTotals> classes;
+    for (LabelTotals& label : totals)
+    {
+        if (label.count > 0) classes.push_back(label);
+    }
+    std::sort(classes.begin(), classes.end(), byRetained);
+
+    std::vector<LabelTotals> roots;
+    for (int node = 1; node < firstObject; node++)
+        roots.push_back({graph.labels[node], 1, 0, retained[node]});
+    std::sort(roots.begin(), roots.end(), byRetained);
+
+    fprintf(out, "%d objects, %zu bytes reachable.\n\n",
+            nodeCount - firstObject, retained[0]);
+
+    fprintf(out, "Retained by class:\n");
+    fprintf(out, "%10s %12s %12s  %s\n", "count", "bytes", "retained",
+            "class");
+    for (LabelTotals& label : classes)
+    {
+        fprintf(out, "%10zu %12zu %12zu  %s\n", label.count, label.shallow,
+                label.retained, graph.labelNames[label.label].c_str());
+    }
+
+    fprintf(out, "\nRetained by root:\n");
+    fprintf(out, "%12s  %s\n", "retained", "root");
+    for (LabelTotals& root : roots)
+    {
+        fprintf(out, "%12zu  %s\n", root.retained,
+                graph.labelNames[root.label].c_str());
+    }
+    return true;
+}
+
+} // namespace lox
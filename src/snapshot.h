@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "common.h"
+
+namespace lox
+{
+
+// A heap snapshot is a text file listing every object reachable from the
+// VM's roots, which are the ones markRoots() marks, with the references
+// between them:
+//
+//   lox heap snapshot 1
+//   root <kind> <name> <id>
+//   object <id> <type> <bytes> <name> <id of each object it references>
+//
+// Roots come first, one line for each reference they hold. Their kinds are
+// stack, frame, upvalue, global, globalName, compiler, shape and init, and
+// globals are named after the variable. An object's bytes are those of its
+// block and of the arrays it owns. Instances and classes are named after
+// the class, functions, closures and bound methods after the function, and
+// a name of "-" means none.
+
+// Writes a snapshot of the heap as it is now. Returns false if path can't
+// be written.
+bool writeHeapSnapshot(const char* path);
+
+// Reads the snapshot at path and writes to out how much memory each class
+// and each global keeps alive: the bytes of the objects that would become
+// garbage without it. Returns false, after reporting why, if path isn't a
+// valid snapshot.
+bool reportHeapSnapshot(const char* path, FILE* out);
+
+} // namespace lox
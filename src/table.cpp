@@ -67,6 +67,7 @@ bool tableGet(Table* table, ObjString* key, Value* value)
 
 static void adjustCapacity(Table* table, int capacity)
 {
+    HeapLock lock;
     Entry* entries = ALLOCATE(Entry, capacity + 1);
 
     for (int i = 0; i <= capacity; i++)
@@ -107,8 +108,8 @@ bool tableSet(Table* table, ObjString* key, Value value)
 
     if (isNewKey && IS_NIL(entry->value)) table->count++;
 
-    entry->key = key;
-    entry->value = value;
+    storeShared(&entry->key, key);
+    storeShared(&entry->value, value);
     return isNewKey;
 }
 
@@ -119,8 +120,8 @@ bool tableDelete(Table* table, ObjString* key)
     Entry* entry = findEntry(table->entries, table->capacity, key);
     if (entry->key == NULL) return false;
 
-    entry->key = NULL;
-    entry->value = BOOL_VAL(true);
+    storeShared(&entry->key, (ObjString*)NULL);
+    storeShared(&entry->value, BOOL_VAL(true));
 
     return true;
 }
@@ -161,20 +162,35 @@ ObjString* tableFindString(Table* table, const char* chars, int length,
 
 void markTable(Table* table)
 {
-    for (int i = 0; i < table->capacity; i++)
+    for (int i = 0; i <= table->capacity; i++)
     {
+        // The key and value may be from different stores. Either way both
+        // were reachable at some point during the mark.
         Entry* entry = &table->entries[i];
-        markObject((Obj*)entry->key);
-        markValue(entry->value);
+        markObject((Obj*)loadShared(&entry->key));
+        markValue(loadShared(&entry->value));
     }
 }
 
-void tableRemoveWhite(Table* table)
+void forwardTable(Table* table)
 {
-    for (int i = 0; i < table->capacity; i++)
+    for (int i = 0; i <= table->capacity; i++)
+    {
+        Entry* entry = &table->entries[i];
+        entry->key = (ObjString*)forwardObject((Obj*)entry->key);
+        forwardValue(&entry->value);
+    }
+}
+
+// A young collection doesn't mark old objects, so with youngOnly only
+// unmarked young keys are treated as dead.
+void tableRemoveWhite(Table* table, bool youngOnly)
+{
+    for (int i = 0; i <= table->capacity; i++)
     {
         Entry* entry = &table->entries[i];
-        if (entry->key != NULL && !entry->key->obj.isMarked)
+        if (entry->key != NULL && !isMarked(&entry->key->obj) &&
+            !(youngOnly && entry->key->obj.isOld))
         {
             tableDelete(table, entry->key);
         }
@@ -29,7 +29,8 @@ ObjString* tableFindString(Table* table, const char* chars, int length,
                            uint32_t hash);
 
 void markTable(Table* table);
+void forwardTable(Table* table);
 
-void tableRemoveWhite(Table* table);
+void tableRemoveWhite(Table* table, bool youngOnly);
 
 } // namespace lox
@@ -24,6 +24,7 @@ bool valuesEqual(Value a, Value b)
     {
         case VAL_BOOL: return AS_BOOL(a) == AS_BOOL(b);
         case VAL_NIL: return true;
+        case VAL_UNDEFINED: return true;
         case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
         case VAL_OBJ: return AS_OBJ(a) == AS_OBJ(b);
         default: return false; // Unreachable.
@@ -49,6 +50,7 @@ void printValue(Value value)
         case VAL_NIL: printf("nil"); break;
         case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
         case VAL_OBJ: printObject(value); break;
+        case VAL_UNDEFINED: printf("undefined"); break;
     }
 #endif
 }
@@ -62,6 +64,7 @@ void ValueArray::init()
 
 void ValueArray::write(Value elem)
 {
+    HeapLock lock;
     if (capacity_ < count_ + 1)
     {
         int oldCapacity = capacity_;
@@ -73,6 +76,13 @@ void ValueArray::write(Value elem)
     count_++;
 }
 
+// Drops the elements from count on, e.g. constants that folding replaced.
+void ValueArray::truncate(int count)
+{
+    HeapLock lock;
+    count_ = count;
+}
+
 void ValueArray::free()
 {
     FREE_ARRAY(Value, elems_, capacity_);
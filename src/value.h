@@ -23,14 +23,16 @@ typedef struct ObjClosure ObjClosure;
 #define SIGN_BIT ((uint64_t)0x8000000000000000)
 #define QNAN ((uint64_t)0x7ffc000000000000)
 
-#define TAG_NIL 1   // 01.
-#define TAG_FALSE 2 // 10.
-#define TAG_TRUE 3  // 11.
+#define TAG_UNDEFINED 0 // 00.
+#define TAG_NIL 1       // 01.
+#define TAG_FALSE 2     // 10.
+#define TAG_TRUE 3      // 11.
 
 typedef uint64_t Value;
 
 #define IS_BOOL(value) (((value) | 1) == TRUE_VAL)
 #define IS_NIL(value) ((value) == NIL_VAL)
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
 #define IS_NUMBER(value) (((value)&QNAN) != QNAN)
 #define IS_OBJ(value) (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
 
@@ -42,6 +44,7 @@ typedef uint64_t Value;
 #define FALSE_VAL ((Value)(uint64_t)(QNAN | TAG_FALSE))
 #define TRUE_VAL ((Value)(uint64_t)(QNAN | TAG_TRUE))
 #define NIL_VAL ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define UNDEFINED_VAL ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
 #define NUMBER_VAL(num) numToValue(num)
 #define OBJ_VAL(obj) (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
 
@@ -67,6 +70,7 @@ typedef enum
     VAL_NIL,
     VAL_NUMBER,
     VAL_OBJ,
+    VAL_UNDEFINED,
 } ValueType;
 
 typedef struct
@@ -82,6 +86,7 @@ typedef struct
 
 #define IS_BOOL(value) ((value).type == VAL_BOOL)
 #define IS_NIL(value) ((value).type == VAL_NIL)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 #define IS_NUMBER(value) ((value).type == VAL_NUMBER)
 #define IS_OBJ(value) ((value).type == VAL_OBJ)
 
@@ -91,11 +96,15 @@ typedef struct
 
 #define BOOL_VAL(value) ((Value){VAL_BOOL, {.boolean = value}})
 #define NIL_VAL ((Value){VAL_NIL, {.number = 0}})
+#define UNDEFINED_VAL ((Value){VAL_UNDEFINED, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
 #define OBJ_VAL(object) ((Value){VAL_OBJ, {.obj = (Obj*)object}})
 
 #endif
 
+// UNDEFINED_VAL never reaches Lox code: it marks a global slot whose variable
+// has been declared by the compiler but not yet defined at runtime.
+
 class ValueArray
 {
   public:
@@ -104,11 +113,13 @@ class ValueArray
 
     void init();
     void write(Value elem);
+    void truncate(int count);
     void free();
 
     int count() const { return count_; };
     int capacity() const { return capacity_; };
     const Value* elems() const { return elems_; };
+    Value* elems() { return elems_; };
 
   private:
     int count_;
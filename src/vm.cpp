@@ -6,10 +6,12 @@
 
 #include <cstdlib>
 
+#include "allocator.h"
 #include "compiler.h"
 #include "debug.h"
 #include "memory.h"
 #include "object.h"
+#include "snapshot.h"
 #include "value.h"
 
 namespace lox
@@ -25,7 +27,7 @@ static Value getEnvNative(int argCount, Value *args)
     ObjString *envKey = AS_STRING(args[0]);
 
     char *envVal = std::getenv(envKey->chars);
-    ObjString *result = takeString(envVal, strlen(envVal));
+    ObjString *result = copyString(envVal, strlen(envVal));
 
     return OBJ_VAL(result);
 }
@@ -38,29 +40,131 @@ static Value sumNative(int argCount, Value *args)
 }
 static Value helloworldNative(int argCount, Value *args)
 {
-    return OBJ_VAL(takeString((char *)"Hello world!", 13));
+    return OBJ_VAL(copyString("Hello world!", 13));
+}
+
+// gcStats() returns an instance with a field for each of the collector's
+// counters, and one holding an instance for each group of them (see
+// visitGCStats()), e.g. gcStats().strings.allocated.
+struct StatsBuilder
+{
+    ObjClass *klass;
+    ObjInstance *stats;
+    ObjInstance *group;
+    const char *groupName;
+};
+
+static void setStatField(ObjInstance *instance, const char *name, Value value)
+{
+    vm.push(OBJ_VAL(copyString(name, (int)strlen(name)))); // For GC
+    instanceSetField(instance, AS_STRING(vm.peek(0)), value);
+    vm.pop();
+}
+
+static void addStat(void *context, const char *group, const char *name,
+                    double value)
+{
+    StatsBuilder *builder = (StatsBuilder *)context;
+    ObjInstance *instance = builder->stats;
+    if (group != NULL)
+    {
+        if (builder->groupName == NULL ||
+            strcmp(group, builder->groupName) != 0)
+        {
+            builder->group = newInstance(builder->klass);
+            vm.push(OBJ_VAL(builder->group)); // For GC
+            setStatField(builder->stats, group, OBJ_VAL(builder->group));
+            vm.pop();
+            builder->groupName = group;
+        }
+        instance = builder->group;
+    }
+    setStatField(instance, name, NUMBER_VAL(value));
+}
+
+// heapSnapshot(path) writes a heap snapshot to path, see snapshot.h, and
+// returns whether it could.
+static Value heapSnapshotNative(int argCount, Value *args)
+{
+    if (argCount != 1 || !IS_STRING(args[0])) return BOOL_VAL(false);
+    return BOOL_VAL(writeHeapSnapshot(AS_CSTRING(args[0])));
+}
+
+static Value gcStatsNative(int argCount, Value *args)
+{
+    // Building the instance allocates, which would change the counters.
+    GCStats counters = vm.gcStats();
+
+    vm.push(OBJ_VAL(copyString("GCStats", 7)));
+    ObjClass *klass = newClass(AS_STRING(vm.peek(0)));
+    vm.push(OBJ_VAL(klass));
+    ObjInstance *stats = newInstance(klass);
+    vm.push(OBJ_VAL(stats));
+
+    StatsBuilder builder = {klass, stats, NULL, NULL};
+    visitGCStats(&counters, addStat, &builder);
+    vm.pop();
+    vm.pop();
+    vm.pop();
+    return OBJ_VAL(stats);
 }
 
 VM::VM()
   : frameCount_(0),
     stackTop_(stack_),
-    objects_(NULL),
+    globalValues_(NULL),
+    globalCapacity_(0),
+    youngCount_(0),
+    youngCapacity_(0),
+    youngObjects_(NULL),
+    youngBytes_(0),
+    collectingYoung_(false),
+    rememberedCount_(0),
+    rememberedCapacity_(0),
+    remembered_(NULL),
     openUpvalues_(NULL),
     initString_(NULL), // For GC, first need to NULL
+    nextClassId_(1),
+    rootShape_(NULL),
+    shapes_(NULL),
+    shapeCount_(0),
+    shapeCapacity_(0),
     grayCount_(0),
     grayCapacity_(0),
     grayStack_(NULL),
+    gcPhase_(GC_IDLE),
+    stepBytes_(0),
+    sweepCursor_{NULL, 0},
+    compactPending_(false),
+    marker_(NULL),
+    markerDone_(false),
+    heapLockDepth_(0),
+    snapshotCount_(0),
+    snapshotCapacity_(0),
+    snapshot_(NULL),
     bytesAllocated_(0),
-    nextGC_(1024 * 1024)
+    nextGC_(GC_MIN_HEAP),
+    liveBytes_(0),
+    idleStart_(0),
+    idleNanos_(0),
+    idleGrowth_(0),
+    workStart_(0),
+    workNanos_(0),
+    stepWork_(GC_STEP_WORK),
+    stepInterval_(GC_STEP_BYTES),
+    markObjectNanos_(0)
 {
-    initTable(&globals_);
+    initTable(&globalSlots_);
     initTable(&strings_);
+    rootShape_ = newRootShape();
     initString_ = copyString("init", 4);
 
     defineNative("clock", clockNative);
     defineNative("getEnv", getEnvNative);
     defineNative("sum", sumNative);
     defineNative("helloworld", helloworldNative);
+    defineNative("gcStats", gcStatsNative);
+    defineNative("heapSnapshot", heapSnapshotNative);
 }
 
 void VM::resetStack()
@@ -75,6 +179,13 @@ InterpretResult VM::interpret(const char *source)
     ObjFunction *function = compile(source);
     if (function == NULL) return INTERPRET_COMPILE_ERROR;
 
+    return interpret(function);
+}
+
+// Runs a top-level script function, either just compiled or loaded from a
+// bytecode file.
+InterpretResult VM::interpret(ObjFunction *function)
+{
     push(OBJ_VAL(function));
     ObjClosure *closure = newClosure(function);
     pop();
@@ -86,356 +197,613 @@ InterpretResult VM::interpret(const char *source)
 
 void VM::free()
 {
-    freeTable(&globals_);
+    freeTable(&globalSlots_);
+    globalNames_.free();
+    FREE_ARRAY(Value, globalValues_, globalCapacity_);
+    globalValues_ = NULL;
+    globalCapacity_ = 0;
     freeTable(&strings_);
     initString_ = NULL;
     freeObjects();
+    freeShapes();
+    freeSlabs();
 }
 
 InterpretResult VM::run()
 {
     // storing the frame in a local variable encourages the C compiler to keep
     // that pointer in a register. (no guarantee , but there’s a good chance it
-    // will.)
-    CallFrame *frame = &frames_[frameCount_ - 1];
+    // will.) The same goes for the instruction pointer, the current function's
+    // constants and the frame's slots: they live in locals while the frame is
+    // running and ip is only written back to the frame (STORE_FRAME) before
+    // anything that can look at it, i.e. calls, returns, runtime errors and
+    // allocations that may trigger the GC.
+    CallFrame *frame;
+    uint8_t *ip;
+    const Value *constants;
+    Value *slots;
+
+#define STORE_FRAME() (frame->ip = ip)
+#define LOAD_FRAME()                                                     \
+    do {                                                                 \
+        frame = &frames_[frameCount_ - 1];                               \
+        ip = frame->ip;                                                  \
+        constants = frame->closure->function->chunk.constants().elems(); \
+        slots = frame->slots;                                            \
+    } while (false)
 
-#define READ_BYTE() (*frame->ip++)
-#define READ_SHORT() \
-    (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
-#define READ_CONSTANT() \
-    (frame->closure->function->chunk.constants().elems()[READ_BYTE()])
-#define READ_STRING() AS_STRING(READ_CONSTANT())
+// Loop back-edges and calls are safepoints: no C++ local holds an object
+// there, so the heap may be compacted.
+#define SAFEPOINT()          \
+    do {                     \
+        if (compactPending_) \
+        {                    \
+            STORE_FRAME();   \
+            compactHeap();   \
+            LOAD_FRAME();    \
+        }                    \
+    } while (false)
+
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_LONG() \
+    (ip += 3, (uint32_t)((ip[-3] << 16) | (ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT() (constants[READ_BYTE()])
+#define OPERAND_STRING() AS_STRING(constants[operand])
+#define GLOBAL_NAME(slot) AS_CSTRING(globalNames_.elems()[slot])
+#define READ_CACHE() (&frame->closure->function->chunk.caches()[READ_SHORT()])
+
+#define RUNTIME_ERROR(...)              \
+    do {                                \
+        STORE_FRAME();                  \
+        runtimeError(__VA_ARGS__);      \
+        return INTERPRET_RUNTIME_ERROR; \
+    } while (false)
 
 #define BINARY_OP(valueType, op)                        \
     do {                                                \
         if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) \
-        {                                               \
-            runtimeError("Operands must be numbers.");  \
-            return INTERPRET_RUNTIME_ERROR;             \
-        }                                               \
+            RUNTIME_ERROR("Operands must be numbers."); \
         double b = AS_NUMBER(pop());                    \
         double a = AS_NUMBER(pop());                    \
         push(valueType(a op b));                        \
     } while (false)
 
+#define LOCALS_OP(op)                                       \
+    do {                                                    \
+        Value a = slots[READ_BYTE()];                       \
+        Value b = slots[READ_BYTE()];                       \
+        if (!IS_NUMBER(a) || !IS_NUMBER(b))                 \
+            RUNTIME_ERROR("Operands must be numbers.");     \
+        push(NUMBER_VAL(AS_NUMBER(a) op AS_NUMBER(b)));     \
+    } while (false)
+
+#define COMPARE_JUMP(op, jumpIf)                            \
+    do {                                                    \
+        Value b = READ_CONSTANT();                          \
+        uint16_t offset = READ_SHORT();                     \
+        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(b))           \
+            RUNTIME_ERROR("Operands must be numbers.");     \
+        double a = AS_NUMBER(pop());                        \
+        if ((a op AS_NUMBER(b)) == jumpIf) ip += offset;    \
+    } while (false)
+
 #ifdef DEBUG_TRACE_EXECUTION
-    std::cout << "********** TRACE EXECUTION **********" << std::endl;
+#define TRACE_INSTRUCTION()                                    \
+    do {                                                       \
+        std::cout << "          ";                             \
+        for (Value *slot = stack_; slot < stackTop_; slot++)   \
+        {                                                      \
+            std::cout << "[ ";                                 \
+            printValue(*slot);                                 \
+            std::cout << " ]";                                 \
+        }                                                      \
+        std::cout << std::endl;                                \
+        disassembleInstruction(                                \
+          &frame->closure->function->chunk,                    \
+          (int)(ip - frame->closure->function->chunk.code())); \
+    } while (false)
+#else
+#define TRACE_INSTRUCTION() \
+    do {                    \
+    } while (false)
+#endif
+
+#ifdef COMPUTED_GOTO
+    // Direct-threaded dispatch: every handler ends with its own indirect jump
+    // through this table, which gives the branch predictor one prediction
+    // site per opcode instead of the single shared one of a switch.
+    static void *dispatchTable[] = {
+#define OPCODE(name) &&code_##name,
+#include "opcodes.h"
+#undef OPCODE
+    };
+
+#define INTERPRET_LOOP DISPATCH();
+#define CASE_CODE(name) code_##name
+#define DISPATCH()                                      \
+    do {                                                \
+        TRACE_INSTRUCTION();                            \
+        goto *dispatchTable[instruction = READ_BYTE()]; \
+    } while (false)
+#else
+#define INTERPRET_LOOP   \
+    loop:                \
+    TRACE_INSTRUCTION(); \
+    switch (instruction = READ_BYTE())
+#define CASE_CODE(name) case name
+#define DISPATCH() goto loop
 #endif
-    for (;;)
-    {
 
 #ifdef DEBUG_TRACE_EXECUTION
-        std::cout << "          ";
-        for (Value *slot = stack_; slot < stackTop_; slot++)
-        {
-            std::cout << "[ ";
-            printValue(*slot);
-            std::cout << " ]";
-        }
-        std::cout << std::endl;
-        disassembleInstruction(
-          &frame->closure->function->chunk,
-          (int)(frame->ip - frame->closure->function->chunk.code()));
+    std::cout << "********** TRACE EXECUTION **********" << std::endl;
 #endif
 
-        uint8_t instruction;
-        switch (instruction = READ_BYTE())
+    LOAD_FRAME();
+
+    // The wide forms of an instruction decode their operand into this and
+    // then jump into the handler of the short form, right past its decoding.
+    uint32_t operand;
+
+    uint8_t instruction;
+    INTERPRET_LOOP
+    {
+        CASE_CODE(OP_CONSTANT):
+            operand = READ_BYTE();
+        doConstant:
+            push(constants[operand]);
+            DISPATCH();
+        CASE_CODE(OP_NIL): push(NIL_VAL); DISPATCH();
+        CASE_CODE(OP_TRUE): push(BOOL_VAL(true)); DISPATCH();
+        CASE_CODE(OP_FALSE): push(BOOL_VAL(false)); DISPATCH();
+        CASE_CODE(OP_EQUAL):
         {
-            case OP_CONSTANT:
-            {
-                Value constant = READ_CONSTANT();
-                push(constant);
-                break;
-            }
-            case OP_NIL: push(NIL_VAL); break;
-            case OP_TRUE: push(BOOL_VAL(true)); break;
-            case OP_FALSE: push(BOOL_VAL(false)); break;
-            case OP_EQUAL:
-            {
-                Value b = pop();
-                Value a = pop();
-                push(BOOL_VAL(valuesEqual(a, b)));
-                break;
-            }
-            case OP_GREATER: BINARY_OP(BOOL_VAL, >); break;
-            case OP_LESS: BINARY_OP(BOOL_VAL, <); break;
-            case OP_ADD:
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1)))
-                    concatenate();
-                else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)))
-                {
-                    double b = AS_NUMBER(pop());
-                    double a = AS_NUMBER(pop());
-                    push(NUMBER_VAL(a + b));
-                }
-                else
-                {
-                    runtimeError(
-                      "Operands must be two numbers or two strings.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
-            case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-            case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
-            case OP_DIVIDE: BINARY_OP(NUMBER_VAL, /); break;
-            case OP_NOT: push(BOOL_VAL(isFalsey(pop()))); break;
-            case OP_NEGATE:
-                if (!IS_NUMBER(peek(0)))
-                {
-                    runtimeError("Operand must be a number.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push(NUMBER_VAL(-AS_NUMBER(pop())));
-                break;
-
-            case OP_PRINT:
-                printValue(pop());
-                std::cout << std::endl;
-                break;
-            case OP_POP: pop(); break;
-            case OP_GET_GLOBAL:
+            Value b = pop();
+            Value a = pop();
+            push(BOOL_VAL(valuesEqual(a, b)));
+            DISPATCH();
+        }
+        CASE_CODE(OP_GREATER): BINARY_OP(BOOL_VAL, >); DISPATCH();
+        CASE_CODE(OP_LESS): BINARY_OP(BOOL_VAL, <); DISPATCH();
+        CASE_CODE(OP_ADD):
+        doAdd:
+            if (IS_STRING(peek(0)) && IS_STRING(peek(1)))
             {
-                ObjString *name = READ_STRING();
-                Value value;
-                if (!tableGet(&globals_, name, &value))
-                {
-                    runtimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push(value);
-                break;
+                STORE_FRAME();
+                concatenate();
             }
-            case OP_SET_GLOBAL:
+            else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)))
             {
-                ObjString *name = READ_STRING();
-                if (tableSet(&globals_, name, peek(0)))
-                {
-                    tableDelete(&globals_, name); // [delete]
-                    runtimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+                double b = AS_NUMBER(pop());
+                double a = AS_NUMBER(pop());
+                push(NUMBER_VAL(a + b));
             }
+            else
+                RUNTIME_ERROR("Operands must be two numbers or two strings.");
+            DISPATCH();
+        CASE_CODE(OP_SUBTRACT): BINARY_OP(NUMBER_VAL, -); DISPATCH();
+        CASE_CODE(OP_MULTIPLY): BINARY_OP(NUMBER_VAL, *); DISPATCH();
+        CASE_CODE(OP_DIVIDE): BINARY_OP(NUMBER_VAL, /); DISPATCH();
+        CASE_CODE(OP_NOT): push(BOOL_VAL(isFalsey(pop()))); DISPATCH();
+        CASE_CODE(OP_NEGATE):
+            if (!IS_NUMBER(peek(0))) RUNTIME_ERROR("Operand must be a number.");
+            push(NUMBER_VAL(-AS_NUMBER(pop())));
+            DISPATCH();
+
+        CASE_CODE(OP_PRINT):
+            printValue(pop());
+            std::cout << std::endl;
+            DISPATCH();
+        CASE_CODE(OP_POP): pop(); DISPATCH();
+        CASE_CODE(OP_GET_GLOBAL):
+        {
+            uint16_t slot = READ_SHORT();
+            Value value = globalValues_[slot];
+            if (IS_UNDEFINED(value))
+                RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));
+            push(value);
+            DISPATCH();
+        }
+        CASE_CODE(OP_SET_GLOBAL):
+        {
+            uint16_t slot = READ_SHORT();
+            if (IS_UNDEFINED(globalValues_[slot]))
+                RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));
+            globalValues_[slot] = peek(0);
+            DISPATCH();
+        }
 
-            case OP_GET_LOCAL:
-            {
-                uint8_t slot = READ_BYTE();
-                push(frame->slots[slot]);
-                break;
-            }
-            case OP_SET_LOCAL:
-            {
-                uint8_t slot = READ_BYTE();
-                frame->slots[slot] = peek(0);
-                break;
-            }
-            case OP_DEFINE_GLOBAL:
-            {
-                ObjString *name = READ_STRING();
-                tableSet(&globals_, name, peek(0));
-                pop();
-                break;
-            }
-            case OP_JUMP_IF_FALSE:
-            {
-                uint16_t offset = READ_SHORT();
-                if (isFalsey(peek(0))) frame->ip += offset;
-                break;
-            }
-            case OP_JUMP:
-            {
-                uint16_t offset = READ_SHORT();
-                frame->ip += offset;
-                break;
-            }
-            case OP_LOOP:
-            {
-                uint16_t offset = READ_SHORT();
-                frame->ip -= offset;
-                break;
-            }
-            case OP_CALL:
-            {
-                int argCount = READ_BYTE();
-                if (!callValue(peek(argCount), argCount))
-                    return INTERPRET_RUNTIME_ERROR;
+        CASE_CODE(OP_GET_LOCAL):
+            operand = READ_BYTE();
+        doGetLocal:
+            push(slots[operand]);
+            DISPATCH();
+        CASE_CODE(OP_SET_LOCAL):
+            operand = READ_BYTE();
+        doSetLocal:
+            slots[operand] = peek(0);
+            DISPATCH();
+        CASE_CODE(OP_DEFINE_GLOBAL):
+        {
+            uint16_t slot = READ_SHORT();
+            globalValues_[slot] = pop();
+            DISPATCH();
+        }
+        CASE_CODE(OP_JUMP_IF_FALSE):
+            operand = READ_SHORT();
+        doJumpIfFalse:
+            if (isFalsey(peek(0))) ip += operand;
+            DISPATCH();
+        CASE_CODE(OP_JUMP):
+            operand = READ_SHORT();
+        doJump:
+            ip += operand;
+            DISPATCH();
+        CASE_CODE(OP_LOOP):
+            operand = READ_SHORT();
+        doLoop:
+            ip -= operand;
+            SAFEPOINT();
+            DISPATCH();
+        CASE_CODE(OP_CALL):
+        {
+            int argCount = READ_BYTE();
+            SAFEPOINT();
+            STORE_FRAME();
+            if (!callValue(peek(argCount), argCount))
+                return INTERPRET_RUNTIME_ERROR;
+
+            LOAD_FRAME();
+            DISPATCH();
+        }
 
-                frame = &frames_[frameCount_ - 1];
-                break;
+        CASE_CODE(OP_CLOSURE):
+            operand = READ_BYTE();
+        doClosure:
+        {
+            ObjFunction *function = AS_FUNCTION(constants[operand]);
+            STORE_FRAME();
+            ObjClosure *closure = newClosure(function);
+            push(OBJ_VAL(closure));
+
+            // The long form widens the captured slot indices as well.
+            bool isLong = instruction == OP_CLOSURE_LONG;
+            for (int i = 0; i < closure->upvalueCount; i++)
+            {
+                uint8_t isLocal = READ_BYTE();
+                uint16_t index = isLong ? READ_SHORT() : READ_BYTE();
+
+                storeShared(&closure->upvalues[i],
+                            isLocal ? captureUpvalue(slots + index)
+                                    : frame->closure->upvalues[index]);
+                // Capturing allocates, which may have promoted the closure.
+                writeBarrier((Obj *)closure, (Obj *)closure->upvalues[i]);
             }
+            DISPATCH();
+        }
 
-            case OP_CLOSURE:
-            {
-                ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
-                ObjClosure *closure = newClosure(function);
-                push(OBJ_VAL(closure));
+        CASE_CODE(OP_GET_UPVALUE):
+            operand = READ_BYTE();
+        doGetUpvalue:
+            push(*frame->closure->upvalues[operand]->location);
+            DISPATCH();
+        CASE_CODE(OP_SET_UPVALUE):
+            operand = READ_BYTE();
+        doSetUpvalue:
+        {
+            ObjUpvalue *upvalue = frame->closure->upvalues[operand];
+            overwriteBarrier(*upvalue->location);
+            storeShared(upvalue->location, peek(0));
+            writeBarrier((Obj *)upvalue, peek(0));
+            DISPATCH();
+        }
 
-                for (int i = 0; i < closure->upvalueCount; i++)
-                {
-                    uint8_t isLocal = READ_BYTE();
-                    uint8_t index = READ_BYTE();
+        CASE_CODE(OP_CLOSE_UPVALUE):
+            closeUpvalues(stackTop_ - 1);
+            pop();
+            DISPATCH();
+
+        CASE_CODE(OP_CLASS):
+            operand = READ_BYTE();
+        doClass:
+            STORE_FRAME();
+            push(OBJ_VAL(newClass(OPERAND_STRING())));
+            DISPATCH();
+
+        CASE_CODE(OP_GET_PROPERTY):
+            operand = READ_BYTE();
+        doGetProperty:
+        {
+            if (!IS_INSTANCE(peek(0)))
+                RUNTIME_ERROR("Only instances have properties.");
 
-                    closure->upvalues[i] =
-                      isLocal ? captureUpvalue(frame->slots + index)
-                              : frame->closure->upvalues[index];
-                }
-                break;
-            }
+            ObjInstance *instance = AS_INSTANCE(peek(0));
+            ObjString *name = OPERAND_STRING();
+            InlineCache *cache = READ_CACHE();
 
-            case OP_GET_UPVALUE:
-            {
-                uint8_t slot = READ_BYTE();
-                push(*frame->closure->upvalues[slot]->location);
-                break;
-            }
-            case OP_SET_UPVALUE:
+            InlineCacheEntry *entry =
+              cache->find(instance->shape, instance->klass->id);
+            if (entry != NULL && entry->method == NULL)
             {
-                uint8_t slot = READ_BYTE();
-                *frame->closure->upvalues[slot]->location = peek(0);
-                break;
+                pop(); // Instance.
+                push(instance->fields[entry->slot]);
+                DISPATCH();
             }
 
-            case OP_CLOSE_UPVALUE:
-                closeUpvalues(stackTop_ - 1);
-                pop();
-                break;
+            STORE_FRAME();
+            if (entry != NULL)
+                bindClosure(entry->method);
+            else if (!getProperty(name, cache))
+                return INTERPRET_RUNTIME_ERROR;
+            DISPATCH();
+        }
+        CASE_CODE(OP_SET_PROPERTY):
+            operand = READ_BYTE();
+        doSetProperty:
+        {
+            if (!IS_INSTANCE(peek(1)))
+                RUNTIME_ERROR("Only instances have fields.");
 
-            case OP_CLASS: push(OBJ_VAL(newClass(READ_STRING()))); break;
+            ObjInstance *instance = AS_INSTANCE(peek(1));
+            ObjString *name = OPERAND_STRING();
+            InlineCache *cache = READ_CACHE();
 
-            case OP_GET_PROPERTY:
+            STORE_FRAME();
+            InlineCacheEntry *entry = cache->find(instance->shape, 0);
+            if (entry != NULL)
             {
-                if (!IS_INSTANCE(peek(0)))
-                {
-                    runtimeError("Only instances have properties.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-
-                ObjInstance *instance = AS_INSTANCE(peek(0));
-                ObjString *name = READ_STRING();
-
-                Value value;
-                if (tableGet(&instance->fields, name, &value))
-                {
-                    pop(); // Instance.
-                    push(value);
-                    break;
-                }
-
-                if (!bindMethod(instance->klass, name))
-                    return INTERPRET_RUNTIME_ERROR;
-                break;
+                if (entry->transition != instance->shape)
+                    setInstanceShape(instance, entry->transition);
+                overwriteBarrier(instance->fields[entry->slot]);
+                storeShared(&instance->fields[entry->slot], peek(0));
+                writeBarrier((Obj *)instance, peek(0));
             }
-            case OP_SET_PROPERTY:
-            {
-                if (!IS_INSTANCE(peek(1)))
-                {
-                    runtimeError("Only instances have fields.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+            else
+                setProperty(name, cache);
 
-                ObjInstance *instance = AS_INSTANCE(peek(1));
-                tableSet(&instance->fields, READ_STRING(), peek(0));
+            Value value = pop();
+            pop();
+            push(value);
+            DISPATCH();
+        }
+        CASE_CODE(OP_METHOD):
+            operand = READ_BYTE();
+        doMethod:
+            // Compiled code always has the class there, but loaded bytecode
+            // is only verified for stack heights, not for what's on it.
+            if (!IS_CLASS(peek(1)))
+                RUNTIME_ERROR("Methods can only be defined on classes.");
+            if (!IS_CLOSURE(peek(0))) RUNTIME_ERROR("Methods must be functions.");
+            STORE_FRAME();
+            defineMethod(OPERAND_STRING());
+            DISPATCH();
+
+        CASE_CODE(OP_INVOKE):
+            operand = READ_BYTE();
+        doInvoke:
+        {
+            ObjString *method = OPERAND_STRING();
+            int argCount = READ_BYTE();
+            InlineCache *cache = READ_CACHE();
+            STORE_FRAME();
+            if (!invoke(method, argCount, cache))
+                return INTERPRET_RUNTIME_ERROR;
+
+            LOAD_FRAME();
+            DISPATCH();
+        }
 
-                Value value = pop();
-                pop();
-                push(value);
-                break;
-            }
-            case OP_METHOD: defineMethod(READ_STRING()); break;
+        CASE_CODE(OP_INHERIT):
+        {
+            Value superclass = peek(1);
+            if (!IS_CLASS(superclass))
+                RUNTIME_ERROR("Superclass must be a class.");
+            if (!IS_CLASS(peek(0)))
+                RUNTIME_ERROR("Methods can only be defined on classes.");
+
+            ObjClass *subclass = AS_CLASS(peek(0));
+            STORE_FRAME();
+            tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
+            writeBarrierAll((Obj *)subclass);
+            subclass->id = nextClassId_++; // Invalidate inline caches.
+            pop(); // Subclass.
+            DISPATCH();
+        }
 
-            case OP_INVOKE:
-            {
-                ObjString *method = READ_STRING();
-                int argCount = READ_BYTE();
-                if (!invoke(method, argCount))
-                {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                frame = &vm.frames()[vm.frameCount_ - 1];
-                break;
-            }
+        CASE_CODE(OP_GET_SUPER):
+            operand = READ_BYTE();
+        doGetSuper:
+        {
+            ObjString *name = OPERAND_STRING();
+            if (!IS_CLASS(peek(0)))
+                RUNTIME_ERROR("Superclass must be a class.");
+            ObjClass *superclass = AS_CLASS(pop());
+            STORE_FRAME();
+            if (!bindMethod(superclass, name))
+                return INTERPRET_RUNTIME_ERROR;
+            DISPATCH();
+        }
+        CASE_CODE(OP_SUPER_INVOKE):
+            operand = READ_BYTE();
+        doSuperInvoke:
+        {
+            ObjString *method = OPERAND_STRING();
+            int argCount = READ_BYTE();
+            InlineCache *cache = READ_CACHE();
+            if (!IS_CLASS(peek(0)))
+                RUNTIME_ERROR("Superclass must be a class.");
+            ObjClass *superclass = AS_CLASS(pop());
+            STORE_FRAME();
+            if (!invokeFromClass(superclass, method, argCount, cache))
+                return INTERPRET_RUNTIME_ERROR;
+
+            LOAD_FRAME();
+            DISPATCH();
+        }
 
-            case OP_INHERIT:
-            {
-                Value superclass = peek(1);
-                if (!IS_CLASS(superclass))
-                {
-                    runtimeError("Superclass must be a class.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+        CASE_CODE(OP_RETURN):
+        {
+            Value result = pop();
 
-                ObjClass *subclass = AS_CLASS(peek(0));
-                tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
-                pop(); // Subclass.
-                break;
-            }
+            closeUpvalues(slots);
 
-            case OP_GET_SUPER:
+            frameCount_--;
+            if (frameCount_ == 0)
             {
-                ObjString *name = READ_STRING();
-                ObjClass *superclass = AS_CLASS(pop());
-                if (!bindMethod(superclass, name))
-                {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
-            }
-            case OP_SUPER_INVOKE:
-            {
-                ObjString *method = READ_STRING();
-                int argCount = READ_BYTE();
-                ObjClass *superclass = AS_CLASS(pop());
-                if (!invokeFromClass(superclass, method, argCount))
-                {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                frame = &vm.frames()[vm.frameCount_ - 1];
-                break;
+                // Finished executing the top-level code.
+                // Pop the main script function from the stack and exit the
+                // interpreter.
+                pop();
+                return INTERPRET_OK;
             }
 
-            case OP_RETURN:
-            {
-                Value result = pop();
-
-                closeUpvalues(frame->slots);
-
-                frameCount_--;
-                if (frameCount_ == 0)
-                {
-                    // Finished executing the top-level code.
-                    // Pop the main script function from the stack and exit the
-                    // interpreter.
-                    pop();
-                    return INTERPRET_OK;
-                }
+            stackTop_ = slots;
+            push(result);
 
-                stackTop_ = frame->slots;
-                push(result);
+            LOAD_FRAME();
+            DISPATCH();
+        }
 
-                frame = &frames_[frameCount_ - 1];
-                break;
+        CASE_CODE(OP_CONSTANT_LONG): operand = READ_LONG(); goto doConstant;
+        CASE_CODE(OP_GET_LOCAL_LONG): operand = READ_SHORT(); goto doGetLocal;
+        CASE_CODE(OP_SET_LOCAL_LONG): operand = READ_SHORT(); goto doSetLocal;
+        CASE_CODE(OP_JUMP_IF_FALSE_LONG):
+            operand = READ_LONG();
+            goto doJumpIfFalse;
+        CASE_CODE(OP_JUMP_LONG): operand = READ_LONG(); goto doJump;
+        CASE_CODE(OP_LOOP_LONG): operand = READ_LONG(); goto doLoop;
+        CASE_CODE(OP_CLOSURE_LONG): operand = READ_LONG(); goto doClosure;
+        CASE_CODE(OP_GET_UPVALUE_LONG):
+            operand = READ_SHORT();
+            goto doGetUpvalue;
+        CASE_CODE(OP_SET_UPVALUE_LONG):
+            operand = READ_SHORT();
+            goto doSetUpvalue;
+        CASE_CODE(OP_CLASS_LONG): operand = READ_LONG(); goto doClass;
+        CASE_CODE(OP_GET_PROPERTY_LONG):
+            operand = READ_LONG();
+            goto doGetProperty;
+        CASE_CODE(OP_SET_PROPERTY_LONG):
+            operand = READ_LONG();
+            goto doSetProperty;
+        CASE_CODE(OP_METHOD_LONG): operand = READ_LONG(); goto doMethod;
+        CASE_CODE(OP_INVOKE_LONG): operand = READ_LONG(); goto doInvoke;
+        CASE_CODE(OP_GET_SUPER_LONG): operand = READ_LONG(); goto doGetSuper;
+        CASE_CODE(OP_SUPER_INVOKE_LONG):
+            operand = READ_LONG();
+            goto doSuperInvoke;
+
+        CASE_CODE(OP_ADD_LOCALS):
+        {
+            Value a = slots[READ_BYTE()];
+            Value b = slots[READ_BYTE()];
+            if (IS_NUMBER(a) && IS_NUMBER(b))
+            {
+                push(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+                DISPATCH();
             }
+            // Strings and type errors take the generic path.
+            push(a);
+            push(b);
+            goto doAdd;
+        }
+        CASE_CODE(OP_SUBTRACT_LOCALS): LOCALS_OP(-); DISPATCH();
+        CASE_CODE(OP_MULTIPLY_LOCALS): LOCALS_OP(*); DISPATCH();
+        CASE_CODE(OP_DIVIDE_LOCALS): LOCALS_OP(/); DISPATCH();
+        CASE_CODE(OP_JUMP_IF_LESS): COMPARE_JUMP(<, true); DISPATCH();
+        CASE_CODE(OP_JUMP_IF_NOT_LESS): COMPARE_JUMP(<, false); DISPATCH();
+        CASE_CODE(OP_JUMP_IF_GREATER): COMPARE_JUMP(>, true); DISPATCH();
+        CASE_CODE(OP_JUMP_IF_NOT_GREATER): COMPARE_JUMP(>, false); DISPATCH();
+        CASE_CODE(OP_INCREMENT_LOCAL):
+        {
+            Value *local = &slots[READ_BYTE()];
+            Value step = READ_CONSTANT();
+            if (!IS_NUMBER(*local))
+                RUNTIME_ERROR("Operands must be two numbers or two strings.");
+            *local = NUMBER_VAL(AS_NUMBER(*local) + AS_NUMBER(step));
+            DISPATCH();
         }
     }
 
+    // Only reachable by the switch fallback on an opcode it doesn't know.
+    return INTERPRET_RUNTIME_ERROR;
+
+#undef STORE_FRAME
+#undef LOAD_FRAME
+#undef SAFEPOINT
 #undef READ_BYTE
+#undef READ_SHORT
+#undef READ_LONG
 #undef READ_CONSTANT
+#undef OPERAND_STRING
+#undef GLOBAL_NAME
+#undef READ_CACHE
+#undef RUNTIME_ERROR
 #undef BINARY_OP
-#undef READ_STRING
+#undef LOCALS_OP
+#undef COMPARE_JUMP
+#undef TRACE_INSTRUCTION
+#undef INTERPRET_LOOP
+#undef CASE_CODE
+#undef DISPATCH
 }
 
-bool VM::invokeFromClass(ObjClass *klass, ObjString *name, int argCount)
+// Looks name up in klass's methods, going through the class-keyed inline
+// cache of an OP_SUPER_INVOKE site first when there is one. Returns NULL if
+// there is no such method.
+ObjClosure *VM::findMethod(ObjClass *klass, ObjString *name,
+                           InlineCache *cache)
 {
+    if (cache != NULL)
+    {
+        InlineCacheEntry *entry = cache->find(NULL, klass->id);
+        if (entry != NULL) return entry->method;
+    }
+
     Value method;
-    if (!tableGet(&klass->methods, name, &method))
+    if (!tableGet(&klass->methods, name, &method)) return NULL;
+
+    InlineCacheEntry *entry =
+      cache != NULL ? cache->claim(NULL, klass->serial) : NULL;
+    if (entry != NULL)
+    {
+        entry->classId = klass->id;
+        entry->classSerial = klass->serial;
+        entry->method = AS_CLOSURE(method);
+    }
+    return AS_CLOSURE(method);
+}
+
+// Fills the entry of a receiver-keyed site for instance: either the field
+// slot, or method when name isn't a field.
+static void cacheProperty(InlineCache *cache, ObjInstance *instance,
+                          ObjClosure *method, int slot)
+{
+    uint64_t serial = method != NULL ? instance->klass->serial : 0;
+    InlineCacheEntry *entry = cache->claim(instance->shape, serial);
+    if (entry == NULL) return;
+
+    entry->shape = instance->shape;
+    entry->classId = method != NULL ? instance->klass->id : 0;
+    entry->classSerial = serial;
+    entry->method = method;
+    entry->transition = instance->shape;
+    entry->slot = slot;
+}
+
+bool VM::invokeFromClass(ObjClass *klass, ObjString *name, int argCount,
+                         InlineCache *cache)
+{
+    ObjClosure *method = findMethod(klass, name, cache);
+    if (method == NULL)
     {
         runtimeError("Undefined property '%s'.", name->chars);
         return false;
     }
-    return call(AS_CLOSURE(method), argCount);
+    return call(method, argCount);
 }
 
-bool VM::invoke(ObjString *name, int argCount)
+bool VM::invoke(ObjString *name, int argCount, InlineCache *cache)
 {
     Value receiver = peek(argCount);
     if (!IS_INSTANCE(receiver))
@@ -446,36 +814,107 @@ bool VM::invoke(ObjString *name, int argCount)
 
     ObjInstance *instance = AS_INSTANCE(receiver);
 
-    Value value;
-    if (tableGet(&instance->fields, name, &value))
+    InlineCacheEntry *entry =
+      cache->find(instance->shape, instance->klass->id);
+    if (entry != NULL && entry->method != NULL)
+        return call(entry->method, argCount);
+
+    int slot = entry != NULL ? entry->slot
+                             : shapeFindSlot(instance->shape, name);
+    if (slot != -1)
     {
+        if (entry == NULL) cacheProperty(cache, instance, NULL, slot);
+
+        Value value = instance->fields[slot];
         vm.stackTop_[-argCount - 1] = value;
         return callValue(value, argCount);
     }
 
-    return invokeFromClass(instance->klass, name, argCount);
+    ObjClosure *method = findMethod(instance->klass, name, NULL);
+    if (method == NULL)
+    {
+        runtimeError("Undefined property '%s'.", name->chars);
+        return false;
+    }
+
+    cacheProperty(cache, instance, method, -1);
+    return call(method, argCount);
+}
+
+// Slow path of OP_GET_PROPERTY, for receivers the site's cache doesn't know.
+bool VM::getProperty(ObjString *name, InlineCache *cache)
+{
+    ObjInstance *instance = AS_INSTANCE(peek(0));
+
+    int slot = shapeFindSlot(instance->shape, name);
+    if (slot != -1)
+    {
+        cacheProperty(cache, instance, NULL, slot);
+        pop(); // Instance.
+        push(instance->fields[slot]);
+        return true;
+    }
+
+    ObjClosure *method = findMethod(instance->klass, name, NULL);
+    if (method == NULL)
+    {
+        runtimeError("Undefined property '%s'.", name->chars);
+        return false;
+    }
+
+    cacheProperty(cache, instance, method, -1);
+    bindClosure(method);
+    return true;
+}
+
+// Slow path of OP_SET_PROPERTY: the instance is at peek(1), the value at
+// peek(0).
+void VM::setProperty(ObjString *name, InlineCache *cache)
+{
+    ObjInstance *instance = AS_INSTANCE(peek(1));
+    Shape *shape = instance->shape;
+
+    instanceSetField(instance, name, peek(0));
+
+    InlineCacheEntry *entry = cache->claim(shape, 0);
+    if (entry == NULL) return;
+
+    entry->shape = shape;
+    entry->transition = instance->shape;
+    entry->slot = shapeFindSlot(instance->shape, name);
 }
 
 bool VM::bindMethod(ObjClass *klass, ObjString *name)
 {
-    Value method;
-    if (!tableGet(&klass->methods, name, &method))
+    ObjClosure *method = findMethod(klass, name, NULL);
+    if (method == NULL)
     {
         runtimeError("Undefined property '%s'.", name->chars);
         return false;
     }
 
-    ObjBoundMethod *bound = newBoundMethod(peek(0), AS_CLOSURE(method));
+    bindClosure(method);
+    return true;
+}
+
+// Replaces the receiver on top of the stack with method bound to it.
+void VM::bindClosure(ObjClosure *method)
+{
+    ObjBoundMethod *bound = newBoundMethod(peek(0), method);
     pop();
     push(OBJ_VAL(bound));
-    return true;
 }
 
 void VM::defineMethod(ObjString *name)
 {
     Value method = peek(0);
     ObjClass *klass = AS_CLASS(peek(1));
+    Value previous;
+    if (tableGet(&klass->methods, name, &previous)) overwriteBarrier(previous);
     tableSet(&klass->methods, name, method);
+    writeBarrier((Obj *)klass, (Obj *)name);
+    writeBarrier((Obj *)klass, method);
+    klass->id = nextClassId_++; // Invalidate inline caches.
     pop();
 }
 
@@ -484,9 +923,12 @@ void VM::closeUpvalues(Value *last)
     while (openUpvalues_ != NULL && openUpvalues_->location >= last)
     {
         ObjUpvalue *upvalue = openUpvalues_;
-        upvalue->closed = *upvalue->location;
+        storeShared(&upvalue->closed, *upvalue->location);
         upvalue->location = &upvalue->closed;
+        writeBarrier((Obj *)upvalue, upvalue->closed);
         openUpvalues_ = upvalue->next;
+        // The upvalue below may die before this one does.
+        upvalue->next = NULL;
     }
 }
 
@@ -543,7 +985,11 @@ bool VM::call(ObjClosure *closure, int argCount)
                      closure->function->arity, argCount);
         return false;
     }
-    if (frameCount_ == FRAMES_MAX)
+    // Functions can have up to UINT16_COUNT locals, so the frame count alone
+    // no longer bounds how much of the stack they take.
+    Value *slots = stackTop_ - argCount - 1;
+    if (frameCount_ == FRAMES_MAX ||
+        slots + closure->function->slotCount > stack_ + STACK_MAX)
     {
         runtimeError("Stack overflow.");
         return false;
@@ -553,7 +999,7 @@ bool VM::call(ObjClosure *closure, int argCount)
     frame->closure = closure;
     frame->ip = closure->function->chunk.code();
 
-    frame->slots = stackTop_ - argCount - 1;
+    frame->slots = slots;
     return true;
 }
 
@@ -609,19 +1055,29 @@ void VM::concatenate()
     ObjString *b = AS_STRING(peek(0)); // For GC
     ObjString *a = AS_STRING(peek(1));
 
-    int length = a->length + b->length;
-    char *chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
+    ObjString *result = newString(a->length + b->length);
+    memcpy(result->chars, a->chars, a->length);
+    memcpy(result->chars + a->length, b->chars, b->length);
 
-    ObjString *result = takeString(chars, length);
+    result = takeString(result);
     pop();
     pop();
 
     push(OBJ_VAL(result));
 }
 
+const GCStats &VM::gcStats()
+{
+    GCStats &stats = lox::gcStats;
+    stats.internedStrings = 0;
+    for (int i = 0; i <= strings_.capacity; i++)
+    {
+        if (strings_.entries[i].key != NULL) stats.internedStrings++;
+    }
+    stats.internTableBytes = sizeof(Entry) * (strings_.capacity + 1);
+    return stats;
+}
+
 void VM::runtimeError(const char *format, ...)
 {
     va_list args;
@@ -632,7 +1088,7 @@ void VM::runtimeError(const char *format, ...)
 
     CallFrame *frame = &frames_[frameCount_ - 1];
     size_t instruction = frame->ip - frame->closure->function->chunk.code() - 1;
-    int line = frame->closure->function->chunk.lines()[instruction];
+    int line = frame->closure->function->chunk.getLine((int)instruction);
     fprintf(stderr, "[line %d] in script\n", line);
 
     for (int i = frameCount_ - 1; i >= 0; i--)
@@ -642,7 +1098,8 @@ void VM::runtimeError(const char *format, ...)
         // -1 because the IP is sitting on the next instruction to be
         // executed.
         size_t instruction = frame->ip - function->chunk.code() - 1;
-        fprintf(stderr, "[line %d] in ", function->chunk.lines()[instruction]);
+        fprintf(stderr, "[line %d] in ",
+                function->chunk.getLine((int)instruction));
         if (function->name == NULL)
             fprintf(stderr, "script\n");
         else
@@ -658,9 +1115,35 @@ void VM::defineNative(const char *name, NativeFn function)
     // with these so that it doesn’t free them out.
     push(OBJ_VAL(copyString(name, (int)strlen(name))));
     push(OBJ_VAL(newNative(function)));
-    tableSet(&globals_, AS_STRING(stack_[0]), stack_[1]);
+    int slot = globalSlot(AS_STRING(stack_[0]));
+    globalValues_[slot] = stack_[1];
+    pop();
     pop();
+}
+
+// Returns the slot of the global variable name, assigning the next free one
+// the first time the name is seen. Slots are never reused, so they stay valid
+// across every chunk compiled into this VM (e.g. REPL lines).
+int VM::globalSlot(ObjString *name)
+{
+    Value slot;
+    if (tableGet(&globalSlots_, name, &slot)) return (int)AS_NUMBER(slot);
+
+    push(OBJ_VAL(name)); // For GC
+    int count = globalNames_.count();
+    if (globalCapacity_ < count + 1)
+    {
+        int oldCapacity = globalCapacity_;
+        globalCapacity_ = GROW_CAPACITY(oldCapacity);
+        globalValues_ =
+          GROW_ARRAY(Value, globalValues_, oldCapacity, globalCapacity_);
+        for (int i = oldCapacity; i < globalCapacity_; i++)
+            globalValues_[i] = UNDEFINED_VAL;
+    }
+    globalNames_.write(OBJ_VAL(name));
+    tableSet(&globalSlots_, name, NUMBER_VAL((double)count));
     pop();
+    return count;
 }
 
 } // namespace lox
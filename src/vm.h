@@ -1,16 +1,26 @@
 #pragma once
 
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+#include "allocator.h"
 #include "chunk.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
 
 #define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// Room for FRAMES_MAX frames of UINT8_COUNT slots, as before functions could
+// have more locals than that, and for one frame with as many as a function
+// can have on top.
+#define STACK_MAX (FRAMES_MAX * UINT8_COUNT + UINT16_COUNT)
 
 namespace lox
 {
 
+struct GCStats;
+
 typedef enum
 {
     INTERPRET_OK,
@@ -18,6 +28,15 @@ typedef enum
     INTERPRET_RUNTIME_ERROR
 } InterpretResult;
 
+// Progress of an incremental full collection, see memory.cpp.
+typedef enum
+{
+    GC_IDLE,
+    GC_MARK,
+    GC_MARK_CONCURRENT,
+    GC_SWEEP
+} GCPhase;
+
 struct CallFrame
 {
     ObjClosure *closure;
@@ -31,7 +50,7 @@ class VM
     VM();
 
     void resetStack();
-    InterpretResult interpret(Chunk *chunk);
+    InterpretResult interpret(ObjFunction *function);
     InterpretResult interpret(const char *source);
     void free();
     void push(Value value);
@@ -44,16 +63,26 @@ class VM
     ObjUpvalue *captureUpvalue(Value *local);
     void closeUpvalues(Value *last);
     void defineMethod(ObjString *name);
+    ObjClosure *findMethod(ObjClass *klass, ObjString *name,
+                           InlineCache *cache);
     bool bindMethod(ObjClass *klass, ObjString *name);
-    bool invoke(ObjString *name, int argCount);
-    bool invokeFromClass(ObjClass *klass, ObjString *name, int argCount);
+    void bindClosure(ObjClosure *method);
+    bool getProperty(ObjString *name, InlineCache *cache);
+    void setProperty(ObjString *name, InlineCache *cache);
+    bool invoke(ObjString *name, int argCount, InlineCache *cache);
+    bool invokeFromClass(ObjClass *klass, ObjString *name, int argCount,
+                         InlineCache *cache);
+
+    // The collector's counters, see memory.h.
+    const GCStats &gcStats();
 
     void runtimeError(const char *format, ...);
     void defineNative(const char *name, NativeFn function);
+    int globalSlot(ObjString *name);
 
-    Obj *objects() const { return objects_; }
     Table *strings() { return &strings_; }
-    Table *globals() { return &globals_; }
+    ValueArray *globalNames() { return &globalNames_; }
+    Value *globalValues() { return globalValues_; }
     Value *stack() { return stack_; }
     Value *stackTop() { return stackTop_; }
     int frameCount() { return frameCount_; }
@@ -68,18 +97,69 @@ class VM
     Value stack_[STACK_MAX];
     Value *stackTop_;
     Table strings_; // intern
-    Table globals_; // global variables
 
-    Obj *objects_;
+    // Global variables live in a flat array. The compiler resolves each name
+    // to a slot once through globalSlot() and emits the slot as the operand
+    // of OP_DEFINE/GET/SET_GLOBAL. A slot holds UNDEFINED_VAL until its
+    // OP_DEFINE_GLOBAL runs.
+    Table globalSlots_;       // name -> slot
+    ValueArray globalNames_;  // slot -> name
+    Value *globalValues_;     // slot -> value
+    int globalCapacity_;
+
+    // Objects start out young and are old once they survive a collection.
+    // Old objects that may point at young ones since they were promoted sit
+    // in the remembered set, see writeBarrier(). Full collections find the
+    // objects by walking the slabs, young ones keep a list of their own.
+    int youngCount_;
+    int youngCapacity_;
+    Obj **youngObjects_; // Objects allocated since the last collection.
+    size_t youngBytes_;  // Bytes allocated since the last collection.
+    bool collectingYoung_;
+    int rememberedCount_;
+    int rememberedCapacity_;
+    Obj **remembered_;
+
     ObjUpvalue *openUpvalues_;
     ObjString *initString_;
+    uint64_t nextClassId_; // 0 is reserved for empty inline cache entries.
+
+    Shape *rootShape_; // Shape of an instance without fields.
+    Shape **shapes_;   // Every shape created, see shape.h.
+    int shapeCount_;
+    int shapeCapacity_;
 
     int grayCount_;
     int grayCapacity_;
     Obj **grayStack_;
 
+    GCPhase gcPhase_;
+    size_t stepBytes_;        // Bytes allocated since the last step.
+    BlockCursor sweepCursor_; // Next object to sweep.
+    bool compactPending_;     // Compact at the next safepoint.
+
+    // Concurrent marking, see gcConfig.concurrentMark.
+    std::thread *marker_;
+    std::atomic<bool> markerDone_;
+    std::recursive_mutex heapLock_; // See HeapLock.
+    int heapLockDepth_;
+    int snapshotCount_;
+    int snapshotCapacity_;
+    Obj **snapshot_; // References logged by the snapshot barriers.
+
     size_t bytesAllocated_;
     size_t nextGC_;
+
+    // Pacing, see pace() in memory.cpp.
+    size_t liveBytes_;       // Heap size after the last full collection.
+    uint64_t idleStart_;     // When it finished, 0 before the first.
+    uint64_t idleNanos_;     // How long the heap then grew until the next,
+    size_t idleGrowth_;      // and by how many bytes.
+    uint64_t workStart_;     // Start of the collector work being timed.
+    uint64_t workNanos_;     // Time taken by the full collection so far.
+    int stepWork_;           // Objects a mark step traces,
+    size_t stepInterval_;    // and bytes allocated between steps.
+    double markObjectNanos_; // Average time to blacken an object.
 };
 
 inline VM vm;
@@ -0,0 +1,34 @@
+#include <gtest/gtest.h>
+
+#include <string>
+
+#include "vm.h"
+
+using namespace lox;
+
+// A function with 8190 locals, counting n and the callee's slot, and 60
+// temporaries on top of them when it stops recursing after depth calls.
+static std::string deepFrames(int depth)
+{
+    std::string source = "fun f(n) { ";
+    for (int i = 0; i < 8188; i++)
+        source += "var v" + std::to_string(i) + " = 0; ";
+
+    std::string sum = "n";
+    for (int i = 0; i < 60; i++) sum = "n + (" + sum + ")";
+    source += "if (n > 0) return f(n - 1); return " + sum + "; } ";
+    source += "if (f(" + std::to_string(depth) + ") != 0) nil();";
+    return source;
+}
+
+TEST(Compiler, SlotCountCoversTemporaries)
+{
+    EXPECT_EQ(vm.interpret(deepFrames(8).c_str()), INTERPRET_OK);
+}
+
+// The last frame fits its locals but not its temporaries, which used to be
+// pushed past the end of the stack.
+TEST(Compiler, TemporariesOverflowTheStack)
+{
+    EXPECT_EQ(vm.interpret(deepFrames(9).c_str()), INTERPRET_RUNTIME_ERROR);
+}
@@ -0,0 +1,51 @@
+#include <gtest/gtest.h>
+
+#include "memory.h"
+#include "vm.h"
+
+using namespace lox;
+
+// Collects often enough for compaction to move objects under a short script.
+class SmallHeap : public ::testing::Test
+{
+  protected:
+    void SetUp() override
+    {
+        saved_ = gcConfig;
+        gcConfig.minHeap = 64 * 1024;
+        gcConfig.nurserySize = 16 * 1024;
+        vm.nextGC_ = gcConfig.minHeap;
+    }
+    void TearDown() override { gcConfig = saved_; }
+
+  private:
+    GCConfig saved_;
+};
+
+// closeUpvalues() used to leave next pointing at the upvalue below, which
+// compaction then forwarded after that one had died. Here fb's upvalue
+// outlives fa's.
+TEST_F(SmallHeap, CompactsClosedUpvalues)
+{
+    const char* source = R"(
+        class Box { init(f, n) { this.f = f; this.n = n; } }
+        var keep = nil;
+        var k = 0;
+        fun outer(i) {
+          k = k + 1; if (k == 50) k = 0;
+          var a = i;
+          var b = i + 1;
+          fun fa() { return a; }
+          fun fb() { return b; }
+          if (k == 0) keep = Box(fb, keep);
+          return fa;
+        }
+        for (var i = 0; i < 30000; i = i + 1) { outer(i); }
+        var junk = nil;
+        for (var j = 0; j < 30000; j = j + 1) { junk = Box(j, junk); }
+        junk = nil;
+        for (var j = 0; j < 30000; j = j + 1) { Box(j, nil); }
+        if (keep.f() != 30000) nil();
+    )";
+    EXPECT_EQ(vm.interpret(source), INTERPRET_OK);
+}
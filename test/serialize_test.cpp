@@ -0,0 +1,66 @@
+#include <gtest/gtest.h>
+
+#include <string>
+
+#include "chunk.h"
+#include "compiler.h"
+#include "serialize.h"
+#include "vm.h"
+
+using namespace lox;
+
+static const char* sharedCacheSource =
+  "class A {} var a = A(); var b = A(); a.x = 1; print b.y;";
+
+// Returns the offset of the first instruction in chunk, or -1 if none.
+static int findInstruction(Chunk* chunk, OpCode instruction)
+{
+    for (int offset = 0; offset < chunk->count();
+         offset += chunk->instructionSize(offset))
+    {
+        if (chunk->code()[offset] == instruction) return offset;
+    }
+    return -1;
+}
+
+static ObjFunction* writeAndLoad(ObjFunction* function, const char* name)
+{
+    std::string path = ::testing::TempDir() + name;
+    EXPECT_TRUE(writeBytecode(path.c_str(), function, 0));
+    return loadBytecode(path.c_str());
+}
+
+TEST(Serialize, LoadsCompiledScript)
+{
+    ObjFunction* function = compile(sharedCacheSource);
+    ASSERT_NE(function, nullptr);
+    EXPECT_NE(writeAndLoad(function, "caches.loxc"), nullptr);
+}
+
+// A get sharing the set's cache would hit on its entry and read the field
+// at the slot the set's transition added, past the end of b's fields.
+TEST(Serialize, RejectsSharedInlineCache)
+{
+    ObjFunction* function = compile(sharedCacheSource);
+    ASSERT_NE(function, nullptr);
+
+    Chunk* chunk = &function->chunk;
+    int set = findInstruction(chunk, OP_SET_PROPERTY);
+    int get = findInstruction(chunk, OP_GET_PROPERTY);
+    ASSERT_NE(set, -1);
+    ASSERT_NE(get, -1);
+    ASSERT_NE(chunk->readShort(set + 2), chunk->readShort(get + 2));
+    chunk->code()[get + 2] = chunk->code()[set + 2];
+    chunk->code()[get + 3] = chunk->code()[set + 3];
+
+    EXPECT_EQ(writeAndLoad(function, "shared_cache.loxc"), nullptr);
+}
+
+TEST(Serialize, RejectsUnusedInlineCache)
+{
+    ObjFunction* function = compile(sharedCacheSource);
+    ASSERT_NE(function, nullptr);
+
+    function->chunk.addInlineCache();
+    EXPECT_EQ(writeAndLoad(function, "extra_cache.loxc"), nullptr);
+}